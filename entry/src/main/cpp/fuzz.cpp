@@ -0,0 +1,218 @@
+// fuzz target for the escape sequence parser
+// build with libFuzzer, after generating width_table.h and utf8proc.o as in the CI workflow:
+// clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address,undefined fuzz.cpp terminal.cpp utf8proc.o -I/usr/include/freetype2 -DSTANDALONE -DTESTING -DHAVE_WIDTH_TABLE -lfreetype -lGLESv2 -lglfw -o fuzz
+// run with the checked-in corpus, sanitizers need a larger time allowance:
+// FUZZ_NS_PER_BYTE=5000 ./fuzz -max_len=65536 fuzz_corpus
+// for AFL or replaying files without libFuzzer, add -DFUZZ_MAIN and drop -fsanitize=fuzzer:
+// afl-fuzz -i fuzz_corpus -o findings -- ./fuzz @@
+#include "terminal.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// parse time allowed per input byte in an optimized build, override with FUZZ_NS_PER_BYTE;
+// a byte may erase or scroll the whole screen, so it counts once more per cells_per_byte cells,
+// and each input gets the time of bytes_per_input bytes more for repeat counts and resizes
+static double ns_per_byte = 300;
+static const double cells_per_byte = 1000;
+static const double bytes_per_input = 30000;
+
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                                   \
+            abort();                                                                                                   \
+        }                                                                                                              \
+    } while (0)
+
+static void CheckInvariants(const terminal_context &ctx) {
+    // cursor and grid
+    CHECK(ctx.row >= 0 && ctx.row < ctx.num_rows);
+    CHECK(ctx.col >= 0 && ctx.col <= ctx.num_cols);
+    CHECK(ctx.scroll_top >= 0 && ctx.scroll_top < ctx.scroll_bottom && ctx.scroll_bottom < ctx.num_rows);
+    CHECK(ctx.buffer.size() == ctx.num_rows);
+    CHECK(ctx.alt_buffer.size() == ctx.num_rows);
+    for (int i = 0; i < ctx.num_rows; i++) {
+        CHECK((int)ctx.buffer[i].size() == ctx.num_cols);
+        CHECK((int)ctx.alt_buffer[i].size() == ctx.num_cols);
+    }
+
+    // grapheme clusters and styles referenced by cells of either screen are alive
+    CHECK(ctx.graphemes.clusters.size() <= grapheme_table::MAX_CLUSTERS);
+    CHECK(ctx.styles.styles.size() <= style_table::MAX_STYLES);
+    for (const term_grid *grid : {&ctx.buffer, &ctx.alt_buffer}) {
+        for (int i = 0; i < ctx.num_rows; i++) {
+            for (auto &c : (*grid)[i]) {
+                if (grapheme_table::IsCluster(c.code)) {
+                    uint32_t index = c.code - term_char::CLUSTER_BASE;
+                    CHECK(index < ctx.graphemes.clusters.size() && !ctx.graphemes.clusters[index].empty());
+                }
+                CHECK(c.style_id < ctx.styles.styles.size());
+            }
+        }
+    }
+
+    // history after the stale lines is as wide as the screen, and no line continues past them unless split
+    CHECK(ctx.history_stale <= ctx.history.size());
+    CHECK(ctx.history_stale == 0 || !ctx.history[ctx.history_stale - 1].wrapped ||
+          ctx.history[ctx.history_stale - 1].split);
+    for (size_t i = ctx.history_stale; i < ctx.history.size(); i++) {
+        CHECK((int)ctx.history[i].cells.size() == ctx.num_cols);
+    }
+
+    // memory does not grow with input
+    CHECK(ctx.history.size() <= history_ring::MAX_LINES);
+    CHECK(ctx.history.slots.size() <= history_ring::MAX_LINES);
+    CHECK(ctx.tokenizer.osc_data.capacity() <= 2 * ctx.tokenizer.clipboard_limit.max_length);
+    CHECK(ctx.tokenizer.payload.length <= ctx.tokenizer.clipboard_limit.max_length);
+    CHECK(ctx.batch.tokens.empty());
+}
+
+// a published snapshot matches the screen, styles and clusters included
+static void CheckSnapshot(terminal_context &ctx) {
+    // as if scrolled up a screenful, which reflows stale history
+    ctx.snapshot_history_lines = ctx.num_rows;
+    ctx.Publish();
+    auto snapshot = ctx.LatestSnapshot();
+    CHECK(snapshot->num_rows == ctx.num_rows && snapshot->num_cols == ctx.num_cols);
+    CHECK(snapshot->row == ctx.row && snapshot->col == ctx.col);
+    size_t lines = std::min((size_t)ctx.num_rows, ctx.history.size());
+    CHECK(snapshot->history.size() == lines && snapshot->history_size == ctx.history.size());
+    CHECK(ctx.history.size() - ctx.history_stale >= lines);
+    // shared history lines are not stale copies of a reused or reflowed slot
+    for (size_t i = ctx.history.size() - lines; i < ctx.history.size(); i++) {
+        const std::vector<term_char> *line = snapshot->HistoryLine(i);
+        const std::vector<term_char> &cells = ctx.history[i].cells;
+        CHECK(line && line->size() == cells.size() &&
+              memcmp(line->data(), cells.data(), cells.size() * sizeof(term_char)) == 0);
+    }
+    for (int i = 0; i < ctx.num_rows; i++) {
+        const std::vector<term_char> &line = *snapshot->rows[i];
+        CHECK((int)line.size() == ctx.num_cols);
+        for (int j = 0; j < ctx.num_cols; j++) {
+            const term_char &c = ctx.buffer[i][j];
+            CHECK(line[j].code == c.code);
+            CHECK(snapshot->Style(line[j]) == ctx.Style(c));
+            size_t length, snapshot_length;
+            const uint32_t *codepoints = ctx.graphemes.Resolve(c.code, length);
+            const uint32_t *snapshot_codepoints = snapshot->Resolve(line[j].code, snapshot_length);
+            CHECK(length == snapshot_length &&
+                  std::equal(codepoints, codepoints + length, snapshot_codepoints));
+        }
+    }
+}
+
+// every changed cell is reported by TakeDamage()
+// cells referenced from the screen keep their style id and cluster code, so compare them as is
+struct CheckDamage {
+    int num_rows, num_cols;
+    std::vector<term_char> cells;
+
+    CheckDamage(const terminal_context &ctx) : num_rows(ctx.num_rows), num_cols(ctx.num_cols) {
+        for (int i = 0; i < num_rows; i++) {
+            cells.insert(cells.end(), ctx.buffer[i].begin(), ctx.buffer[i].end());
+        }
+    }
+
+    void Covered(terminal_context &ctx) {
+        term_damage damage = ctx.TakeDamage();
+        CHECK(damage.rows.size() == ctx.num_rows);
+        if (damage.full || ctx.num_rows != num_rows || ctx.num_cols != num_cols) {
+            return;
+        }
+        for (int i = 0; i < num_rows; i++) {
+            for (int j = 0; j < num_cols; j++) {
+                const term_char &before = cells[i * num_cols + j], &after = ctx.buffer[i][j];
+                if (before.code != after.code || before.style_id != after.style_id) {
+                    if (!(damage.rows[i].begin <= j && j < damage.rows[i].end)) {
+                        fprintf(stderr, "cell %d,%d changed outside damage [%d, %d)\n", i, j, damage.rows[i].begin,
+                                damage.rows[i].end);
+                        abort();
+                    }
+                }
+            }
+        }
+    }
+};
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    if (const char *env = getenv("FUZZ_NS_PER_BYTE")) {
+        ns_per_byte = atof(env);
+    }
+    return 0;
+}
+
+// first three bytes select terminal size and chunk size
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < 3) {
+        return 0;
+    }
+    int rows = 2 + data[0] % 63;
+    int cols = 1 + data[1] % 256;
+    size_t chunk = 1 + data[2] % 128;
+    data += 3;
+    size -= 3;
+
+    terminal_context ctx;
+    ctx.ResizeTo(rows, cols);
+
+    // time parsing only, checks are much slower
+    double elapsed = 0;
+    int cells = rows * cols;
+    for (size_t i = 0; i < size; i += chunk) {
+        CheckDamage before(ctx);
+        auto begin = std::chrono::steady_clock::now();
+        ctx.ParseBuffer(data + i, std::min(chunk, size - i));
+        elapsed += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+        cells = std::max(cells, ctx.num_rows * ctx.num_cols);
+        CheckInvariants(ctx);
+        before.Covered(ctx);
+        CheckSnapshot(ctx);
+    }
+    if (elapsed > ns_per_byte * (bytes_per_input + size * (1 + cells / cells_per_byte))) {
+        fprintf(stderr, "parsing %zu bytes took %.0f ns\n", size, elapsed);
+        abort();
+    }
+
+    // bulk parsing must match parsing byte by byte
+    terminal_context ref;
+    ref.ResizeTo(rows, cols);
+    for (size_t i = 0; i < size; i++) {
+        ref.Parse(data[i]);
+    }
+    // DECCOLM may have resized both terminals
+    CHECK(ctx.num_rows == ref.num_rows && ctx.num_cols == ref.num_cols);
+    CHECK(ctx.row == ref.row && ctx.col == ref.col);
+    for (int i = 0; i < ctx.num_rows; i++) {
+        for (int j = 0; j < ctx.num_cols; j++) {
+            CHECK(ctx.buffer[i][j].code == ref.buffer[i][j].code);
+            CHECK(ctx.Style(ctx.buffer[i][j]) == ref.Style(ref.buffer[i][j]));
+        }
+    }
+    return 0;
+}
+
+#ifdef FUZZ_MAIN
+int main(int argc, char **argv) {
+    LLVMFuzzerInitialize(&argc, &argv);
+    for (int i = 1; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (!fp) {
+            perror(argv[i]);
+            return 1;
+        }
+        std::vector<uint8_t> data;
+        uint8_t temp[4096];
+        size_t r;
+        while ((r = fread(temp, 1, sizeof(temp), fp)) > 0) {
+            data.insert(data.end(), temp, temp + r);
+        }
+        fclose(fp);
+        LLVMFuzzerTestOneInput(data.data(), data.size());
+    }
+    return 0;
+}
+#endif
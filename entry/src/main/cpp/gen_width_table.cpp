@@ -0,0 +1,91 @@
+// generate width_table.h from the vendored utf8proc data, run by CMakeLists.txt and the test workflow
+// to run manually, then build with -DHAVE_WIDTH_TABLE and utf8proc.o instead of -lutf8proc:
+// clang -O2 -DUTF8PROC_STATIC -c utf8proc/utf8proc.c -o utf8proc.o
+// clang++ -std=c++17 -DUTF8PROC_STATIC gen_width_table.cpp utf8proc.o -o gen_width_table && ./gen_width_table width_table.h
+#include "utf8proc/utf8proc.h"
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <vector>
+
+static constexpr int BLOCK_SHIFT = 7;
+static constexpr int BLOCK_SIZE = 1 << BLOCK_SHIFT;
+static constexpr int NUM_CODEPOINTS = 0x110000;
+
+// width when east asian ambiguous characters are treated as wide
+static int AmbiguousWideWidth(int32_t codepoint) {
+#if UTF8PROC_VERSION_MAJOR > 2 || (UTF8PROC_VERSION_MAJOR == 2 && UTF8PROC_VERSION_MINOR >= 10)
+    if (utf8proc_charwidth_ambiguous(codepoint)) {
+        return 2;
+    }
+#endif
+    // older utf8proc does not expose ambiguous width, same as narrow
+    return utf8proc_charwidth(codepoint);
+}
+
+// split widths into blocks, deduplicate blocks and return the index
+static std::vector<uint16_t> BuildIndex(int (*width)(int32_t), std::vector<std::vector<uint8_t>> &blocks,
+                                        std::map<std::vector<uint8_t>, uint16_t> &block_ids) {
+    std::vector<uint16_t> index;
+    for (int32_t base = 0; base < NUM_CODEPOINTS; base += BLOCK_SIZE) {
+        std::vector<uint8_t> block(BLOCK_SIZE);
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            int w = width(base + i);
+            block[i] = w < 0 ? 0 : w;
+        }
+        auto it = block_ids.find(block);
+        if (it == block_ids.end()) {
+            it = block_ids.insert({block, (uint16_t)blocks.size()}).first;
+            blocks.push_back(block);
+        }
+        index.push_back(it->second);
+    }
+    return index;
+}
+
+template <typename T>
+static void PrintArray(FILE *fp, const char *type, const char *name, const std::vector<T> &values) {
+    fprintf(fp, "static constexpr %s %s[%zu] = {", type, name, values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        fprintf(fp, "%s%d,", i % 16 == 0 ? "\n    " : " ", (int)values[i]);
+    }
+    fprintf(fp, "\n};\n\n");
+}
+
+int main(int argc, char **argv) {
+    FILE *fp = argc > 1 ? fopen(argv[1], "w") : stdout;
+    if (!fp) {
+        perror("fopen");
+        return 1;
+    }
+
+    std::vector<std::vector<uint8_t>> blocks;
+    std::map<std::vector<uint8_t>, uint16_t> block_ids;
+    std::vector<uint16_t> narrow = BuildIndex(
+        [](int32_t codepoint) { return utf8proc_charwidth(codepoint); }, blocks, block_ids);
+    std::vector<uint16_t> wide = BuildIndex(AmbiguousWideWidth, blocks, block_ids);
+
+    std::vector<uint8_t> widths;
+    for (auto &block : blocks) {
+        widths.insert(widths.end(), block.begin(), block.end());
+    }
+
+    fprintf(fp, "// generated by gen_width_table.cpp from utf8proc %s, do not edit\n", utf8proc_version());
+    fprintf(fp, "#ifndef __WIDTH_TABLE_H__\n#define __WIDTH_TABLE_H__\n\n");
+    fprintf(fp, "#include <cstdint>\n\n");
+    fprintf(fp, "// width of codepoint c is width_blocks[index[c >> WIDTH_BLOCK_SHIFT] << WIDTH_BLOCK_SHIFT | (c & WIDTH_BLOCK_MASK)]\n");
+    fprintf(fp, "static constexpr uint32_t WIDTH_BLOCK_SHIFT = %d;\n", BLOCK_SHIFT);
+    fprintf(fp, "static constexpr uint32_t WIDTH_BLOCK_MASK = %d;\n", BLOCK_SIZE - 1);
+    fprintf(fp, "static constexpr uint32_t WIDTH_TABLE_SIZE = 0x%x;\n\n", NUM_CODEPOINTS);
+    fprintf(fp, "// east asian ambiguous characters are narrow\n");
+    PrintArray(fp, "uint16_t", "width_index_narrow", narrow);
+    fprintf(fp, "// east asian ambiguous characters are wide\n");
+    PrintArray(fp, "uint16_t", "width_index_wide", wide);
+    PrintArray(fp, "uint8_t", "width_blocks", widths);
+    fprintf(fp, "#endif\n");
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+    return 0;
+}
@@ -130,6 +130,32 @@ static napi_value ResizeSurface(napi_env env, napi_callback_info info) {
     return nullptr;
 }
 
+static napi_value SetResizeDelayMsec(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    int msec = 0;
+    napi_status res = napi_get_value_int32(env, args[0], &msec);
+    assert(res == napi_ok);
+
+    SetResizeDelay(msec);
+    return nullptr;
+}
+
+static napi_value SetAmbiguousWideChars(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value args[1] = {nullptr};
+    napi_get_cb_info(env, info, &argc, args, nullptr, nullptr);
+
+    bool wide = false;
+    napi_status res = napi_get_value_bool(env, args[0], &wide);
+    assert(res == napi_ok);
+
+    SetAmbiguousWide(wide);
+    return nullptr;
+}
+
 static napi_value Scroll(napi_env env, napi_callback_info info) {
     size_t argc = 1;
     napi_value args[1] = {nullptr};
@@ -240,6 +266,8 @@ static napi_value Init(napi_env env, napi_value exports) {
         {"createSurface", nullptr, CreateSurface, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"destroySurface", nullptr, DestroySurface, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"resizeSurface", nullptr, ResizeSurface, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"setResizeDelay", nullptr, SetResizeDelayMsec, nullptr, nullptr, nullptr, napi_default, nullptr},
+        {"setAmbiguousWide", nullptr, SetAmbiguousWideChars, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"scroll", nullptr, Scroll, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"checkCopy", nullptr, CheckCopy, nullptr, nullptr, nullptr, napi_default, nullptr},
         {"checkPaste", nullptr, CheckPaste, nullptr, nullptr, nullptr, napi_default, nullptr},
@@ -7,9 +7,13 @@
 #include <GLES3/gl32.h>
 #include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdarg>
 #include <cstdint>
+#include <cstring>
+#include <ctime>
 #include <deque>
+#include <iterator>
 #include <map>
 #include <set>
 #include <string>
@@ -24,6 +28,17 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef HAVE_WIDTH_TABLE
+// generated by gen_width_table.cpp at build time
+#include "width_table.h"
+#endif
+
 #ifdef STANDALONE
 #define LOG_INFO(fmt, ...) fprintf(stderr, fmt "\n", __VA_ARGS__)
 #define LOG_WARN(fmt, ...) fprintf(stderr, fmt "\n", __VA_ARGS__)
@@ -87,27 +102,28 @@ static uint32_t predefined_colors[NUM_TERM_COLORS] = {
     [brwhite] = PACK_RGB( 253, 246, 227 ),
 };
 
+// default colors
+static const uint32_t default_fore = predefined_colors[black];
+static const uint32_t default_back = predefined_colors[white];
+
 term_style::term_style() {
-    fore = predefined_colors[black];
-    back = predefined_colors[white];
+    fore = color::DefaultFore();
+    back = color::DefaultBack();
+    underline_color = color::DefaultFore();
 }
 
-static std::vector<std::string> SplitString(const std::string &str, const std::string &delimiter) {
-    std::vector<std::string> result;
-    size_t start = 0;
-    size_t end = str.find(delimiter);
-    while (end != std::string::npos) {
-        result.push_back(str.substr(start, end - start));
-        start = end + delimiter.length();
-        end = str.find(delimiter, start);
-    }
-    result.push_back(str.substr(start));
-    return result;
+term_palette::term_palette() {
+    std::copy(std::begin(predefined_colors), std::end(predefined_colors), colors);
+    std::copy(std::begin(color_map_256) + NUM_TERM_COLORS, std::end(color_map_256), colors + NUM_TERM_COLORS);
+    fore = default_fore;
+    back = default_back;
 }
 
 // viewport width/height = [font_width, font_height] . [num_cols, num_rows]
 static int buffer_width = 0;
 static int buffer_height = 0;
+// viewport changed, the grid follows on the next frame
+static bool resize_pending = false;
 static int
 #ifdef STANDALONE
 
@@ -163,26 +179,360 @@ static std::vector<struct font_spec> fonts {
 #endif
 };
 
-const int MAX_HISTORY_LINES = 5000;
 // scroll offset in y axis
 static float scroll_offset = 0;
 
-constexpr uint32_t TrueColorFrom(uint8_t index) {
-    return color_map_256[index];
+void term_grid::Resize(int num_rows, int num_cols) {
+    // copy rows in screen order into a single new allocation
+    std::vector<term_char> new_cells(num_rows * num_cols);
+    std::vector<uint8_t> new_wrapped(num_rows);
+    for (int i = 0; i < (int)index.size() && i < num_rows; i++) {
+        const term_char *line = cells.data() + index[i] * stride;
+        std::copy(line, line + std::min(stride, num_cols), new_cells.begin() + i * num_cols);
+        new_wrapped[i] = wrapped[index[i]];
+    }
+    cells.swap(new_cells);
+    wrapped.swap(new_wrapped);
+    stride = num_cols;
+    blank.assign(num_cols, blank_value);
+
+    index.resize(num_rows);
+    for (int i = 0; i < num_rows; i++) {
+        index[i] = i;
+    }
+}
+
+history_line &history_ring::PushBack(int width) {
+    if (count == slots.size()) {
+        if (slots.size() < MAX_LINES) {
+            Grow();
+        } else {
+            PopFront();
+        }
+    }
+    history_line &line = (*this)[count++];
+    if (line.cells.capacity() < (size_t)width) {
+        allocations++;
+    } else {
+        reuses++;
+    }
+    line.cells.resize(width);
+    line.wrapped = false;
+    line.padded = false;
+    line.split = false;
+    line.shared.reset();
+    return line;
+}
+
+void history_ring::PopFront() {
+    head = (head + 1) % slots.size();
+    count--;
+}
+
+void history_ring::Erase(size_t first, size_t last) {
+    // swap erased lines past the end
+    size_t n = last - first;
+    for (size_t i = first; i + n < count; i++) {
+        std::swap((*this)[i], (*this)[i + n]);
+    }
+    count -= n;
+}
+
+size_t history_ring::Insert(size_t pos, std::vector<history_line> &lines) {
+    // drop the oldest lines to make room, and inserted lines if still too many
+    size_t n = lines.size();
+    size_t drop = count + n > MAX_LINES ? count + n - MAX_LINES : 0;
+    size_t drop_old = std::min(drop, pos);
+    for (size_t i = 0; i < drop_old; i++) {
+        PopFront();
+    }
+    pos -= drop_old;
+    size_t skip = drop - drop_old;
+
+    while (slots.size() - count < n - skip) {
+        Grow();
+    }
+    // move lines after pos up, spare slots come down to pos
+    count += n - skip;
+    for (size_t i = count; i-- > pos + n - skip;) {
+        std::swap((*this)[i], (*this)[i - (n - skip)]);
+    }
+    for (size_t i = skip; i < n; i++) {
+        std::swap((*this)[pos + i - skip], lines[i]);
+    }
+    return pos;
+}
+
+void history_ring::Grow() {
+    std::rotate(slots.begin(), slots.begin() + head, slots.end());
+    head = 0;
+    slots.emplace_back();
+}
+
+// lays out logical lines in rows of a new width
+struct reflow_writer {
+    // a position carried through reflow, row is -1 if not in the lines added
+    struct mark {
+        int row = -1;
+        int col = 0;
+    };
+    int num_cols;
+    std::vector<history_line> rows;
+    // where the cursor and the saved cursor land
+    mark cursor, saved;
+
+    reflow_writer(int num_cols) : num_cols(num_cols) {}
+
+    // start a new row, the current one continues in it
+    void Wrap() {
+        if (!rows.empty()) {
+            rows.back().padded = (int)rows.back().cells.size() < num_cols;
+            rows.back().cells.resize(num_cols);
+            rows.back().wrapped = true;
+        }
+        rows.emplace_back();
+        rows.back().cells.reserve(num_cols);
+    }
+
+    // append a logical line, cursor offsets into cells are -1 if not in this line
+    void AddLine(const std::vector<term_char> &cells, bool wrapped, int cursor_offset, int saved_offset) {
+        // trailing blanks are dropped, except up to a cursor
+        int length = cells.size();
+        while (length > 0 && cells[length - 1].code == ' ' && cells[length - 1].style_id == 0) {
+            length--;
+        }
+        length = std::max({length, cursor_offset, saved_offset});
+
+        // a cursor on either half of a wide char stays on it
+        auto place = [&](mark &m, int offset, int i, int col, int width) {
+            if (i == offset || (width == 2 && i + 1 == offset)) {
+                m.row = rows.size() - 1;
+                m.col = std::min(col + (i + 1 == offset), num_cols);
+            }
+        };
+
+        rows.emplace_back();
+        rows.back().cells.reserve(num_cols);
+        for (int i = 0; i < length; i++) {
+            // wide chars move to the next row as a whole
+            int width = i + 1 < (int)cells.size() && cells[i + 1].code == term_char::WIDE_TAIL ? 2 : 1;
+            int col = rows.back().cells.size();
+            if (col == num_cols || (col + width > num_cols && col > 0)) {
+                Wrap();
+                col = 0;
+            }
+            place(cursor, cursor_offset, i, col, width);
+            place(saved, saved_offset, i, col, width);
+            rows.back().cells.push_back(cells[i]);
+            if (width == 2) {
+                // the tail is dropped if a single column can not hold it
+                if (col + 1 < num_cols) {
+                    rows.back().cells.push_back(cells[i + 1]);
+                }
+                i++;
+            }
+        }
+        place(cursor, cursor_offset, length, rows.back().cells.size(), 1);
+        place(saved, saved_offset, length, rows.back().cells.size(), 1);
+        rows.back().cells.resize(num_cols);
+        rows.back().wrapped = wrapped;
+    }
+};
+
+// cells a row adds to a logical line, without the blank of a padded row,
+// or any trailing blanks of a split row, which reflow left short
+static int JoinedLength(const_term_row cells, bool padded, bool split) {
+    int length = cells.size();
+    auto trailing_blank = [&]() {
+        return length > 0 && cells[length - 1].code == ' ' && cells[length - 1].style_id == 0;
+    };
+    if (padded && trailing_blank()) {
+        length--;
+    }
+    while (split && trailing_blank()) {
+        length--;
+    }
+    return length;
+}
+
+// append a row to a logical line, see JoinedLength()
+static void JoinRow(std::vector<term_char> &line, const_term_row cells, bool padded, bool split = false) {
+    line.insert(line.end(), cells.begin(), cells.begin() + JoinedLength(cells, padded, split));
+}
+
+void tab_stop_set::Resize(int new_num_cols, int tab_size) {
+    // clear stops beyond the new width, so they do not come back when growing
+    for (int i = new_num_cols; i < num_cols; i++) {
+        Clear(i);
+    }
+    words.resize((new_num_cols + 63) / 64);
+    // from the first multiple of tab_size at or after the old width
+    int first = (num_cols + tab_size - 1) / tab_size * tab_size;
+    num_cols = new_num_cols;
+    for (int i = first; i < num_cols; i += tab_size) {
+        Set(i);
+    }
+}
+
+int tab_stop_set::Next(int col) const {
+    int begin = std::max(col + 1, 0);
+    if (begin >= num_cols) {
+        return num_cols - 1;
+    }
+    int word = begin >> 6;
+    // ignore stops before begin in the first word
+    uint64_t bits = words[word] & (~0ull << (begin & 63));
+    while (bits == 0) {
+        if (++word == (int)words.size()) {
+            return num_cols - 1;
+        }
+        bits = words[word];
+    }
+    return std::min(word * 64 + __builtin_ctzll(bits), num_cols - 1);
+}
+
+int tab_stop_set::Prev(int col) const {
+    int end = std::min(col, num_cols);
+    if (end <= 0) {
+        return 0;
+    }
+    int word = (end - 1) >> 6;
+    // ignore stops at or after end in the last word
+    uint64_t bits = words[word] & (~0ull >> (63 - ((end - 1) & 63)));
+    while (bits == 0) {
+        if (--word < 0) {
+            return 0;
+        }
+        bits = words[word];
+    }
+    return word * 64 + 63 - __builtin_clzll(bits);
+}
+
+void term_damage::AddRows(int first, int last, int num_cols) {
+    for (int i = first; i < last; i++) {
+        rows[i].begin = 0;
+        rows[i].end = num_cols;
+    }
+}
+
+bool term_damage::Empty() const {
+    if (full) {
+        return false;
+    }
+    for (const span &s : rows) {
+        if (s.begin < s.end) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void term_damage::Reset(int num_rows) {
+    rows.assign(num_rows, span());
+    full = false;
+}
+
+void terminal_context::Publish() {
+    auto next = std::make_shared<term_snapshot>();
+    next->num_rows = num_rows;
+    next->num_cols = num_cols;
+    next->row = row;
+    next->col = col;
+    next->show_cursor = show_cursor;
+    next->reverse_video = reverse_video;
+    next->palette = palette;
+
+    // share rows whose content is unchanged, rotated rows keep their storage row
+    snapshot_rows.resize(num_rows);
+    next->rows.resize(num_rows);
+    for (int i = 0; i < num_rows; i++) {
+        term_snapshot::shared_row &cached = snapshot_rows[buffer.index[i]];
+        const_term_row line = buffer[i];
+        if (!cached || (int)cached->size() != num_cols ||
+            memcmp(cached->data(), line.cells, num_cols * sizeof(term_char)) != 0) {
+            cached = std::make_shared<const std::vector<term_char>>(line.begin(), line.end());
+        }
+        next->rows[i] = cached;
+    }
+
+    // history lines are only copied and reflowed when scrolled into view,
+    // and shared with later snapshots until their slot is reused
+    size_t scroll_lines = std::max(snapshot_history_lines.load(), 0);
+    ReflowHistory(scroll_lines);
+    size_t begin, end;
+    term_snapshot::HistoryWindow(history.size(), scroll_lines, std::max(snapshot_view_lines.load(), 0), begin,
+                                 end);
+    for (size_t i = snapshot_history_begin; i < std::min(snapshot_history_end, history.size()); i++) {
+        if (i < begin || i >= end) {
+            history[i].shared.reset();
+        }
+    }
+    next->history.reserve(end - begin);
+    for (size_t i = begin; i < end; i++) {
+        history_line &line = history[i];
+        if (!line.shared) {
+            line.shared = std::make_shared<const std::vector<term_char>>(line.cells);
+        }
+        next->history.push_back(line.shared);
+    }
+    next->history_begin = begin;
+    next->history_size = history.size();
+    snapshot_history_begin = begin;
+    snapshot_history_end = end;
+
+    // tables are copied only after new entries
+    if (!snapshot_styles || snapshot_styles_version != styles.version) {
+        snapshot_styles = std::make_shared<const std::vector<term_style>>(styles.styles);
+        snapshot_styles_version = styles.version;
+    }
+    if (!snapshot_clusters || snapshot_clusters_version != graphemes.version) {
+        snapshot_clusters = std::make_shared<const std::vector<std::vector<uint32_t>>>(graphemes.clusters);
+        snapshot_clusters_version = graphemes.version;
+    }
+    next->styles = snapshot_styles;
+    next->clusters = snapshot_clusters;
+
+    std::atomic_store(&snapshot, std::shared_ptr<const term_snapshot>(std::move(next)));
+    snapshot_pending = false;
+    snapshot_wanted = false;
+}
+
+term_damage terminal_context::TakeDamage() {
+    term_damage result;
+    result.Reset(num_rows);
+    std::swap(result, damage);
+    return result;
+}
+
+// milliseconds from a monotonic clock
+static uint64_t MonotonicMsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 void terminal_context::ResizeTo(int new_term_row, int new_term_col) {
-    int old_term_col = num_cols;
+    if (new_term_col != num_cols) {
+        // history keeps its width until scrolled into view
+        history_stale = history.size();
+    }
+    ReflowScreen(new_term_row, new_term_col);
+
     num_rows = new_term_row;
     num_cols = new_term_col;
+    damage.Reset(num_rows);
+    damage.AddAll();
+    snapshot_pending = true;
 
     // update scroll margin
     scroll_top = 0;
     scroll_bottom = num_rows - 1;
 
-    buffer.resize(num_rows);
-    for (int i = 0; i < num_rows; i++) {
-        buffer[i].resize(num_cols);
+    // applications redraw the alternate screen after resize
+    if (alternate_screen) {
+        buffer.Resize(num_rows, num_cols);
+    } else {
+        alt_buffer.Resize(num_rows, num_cols);
     }
 
     if (row > num_rows - 1) {
@@ -193,74 +543,689 @@ void terminal_context::ResizeTo(int new_term_row, int new_term_col) {
         col = num_cols - 1;
     }
 
-    tab_stops.resize(num_cols);
-    for (int i = old_term_col;i < num_cols;i += tab_size) {
-        tab_stops[i] = true;
-    }
+    tab_stops.Resize(num_cols, tab_size);
+
+    // every resize restarts the delay, see ReportSize()
+    resize_msec = MonotonicMsec();
+}
 
+bool terminal_context::ReportSize(uint64_t now_msec) {
+    if ((num_rows == winsize_rows && num_cols == winsize_cols) || now_msec < resize_msec + resize_delay_msec) {
+        return false;
+    }
     struct winsize ws = {};
     ws.ws_col = num_cols;
     ws.ws_row = num_rows;
     ioctl(fd, TIOCSWINSZ, &ws);
+    winsize_rows = num_rows;
+    winsize_cols = num_cols;
+    return true;
 }
 
 void terminal_context::DropFirstRowIfOverflow() {
-    if (row == scroll_bottom + 1) {
-        // drop first row in scrolling margin
+    if (row == scroll_bottom + 1 && alternate_screen) {
+        // full screen applications redraw on the alternate screen, keep history for real output
+        buffer.ClearRow(scroll_top, Blank());
+        buffer.Rotate(scroll_top, scroll_top + 1, scroll_bottom + 1);
+        damage.AddRows(scroll_top, scroll_bottom + 1, num_cols);
+        row--;
+    } else if (row == scroll_bottom + 1) {
+        // copy first row in scrolling margin into history
         assert(scroll_top < scroll_bottom);
-        history.push_back(buffer[scroll_top]);
-        buffer.erase(buffer.begin() + scroll_top);
-        buffer.insert(buffer.begin() + scroll_bottom, std::vector<term_char>());
-        buffer[scroll_bottom].resize(num_cols);
+        assert(!alternate_screen);
+        history_line &line = PushHistory(num_cols);
+        term_row top = buffer[scroll_top];
+        std::copy(top.begin(), top.end(), line.cells.begin());
+        line.wrapped = buffer.Wrapped(scroll_top);
+        line.padded = buffer.Padded(scroll_top);
+
+        // clear it and move to the bottom
+        buffer.ClearRow(scroll_top, Blank());
+        buffer.Rotate(scroll_top, scroll_top + 1, scroll_bottom + 1);
+        damage.AddRows(scroll_top, scroll_bottom + 1, num_cols);
         row--;
-
-        while (history.size() > MAX_HISTORY_LINES) {
-            history.pop_front();
-        }
     } else if (row >= num_rows) {
         row = num_rows - 1;
     }
 }
 
-int char_width(uint32_t codepoint) {
-    return utf8proc_charwidth(codepoint);
+void terminal_context::UnwrapHistory() {
+    // the alternate screen never continues history
+    if (!alternate_screen && !history.empty()) {
+        history.back().wrapped = false;
+        history.back().split = false;
+    }
+}
+
+history_line &terminal_context::PushHistory(int width) {
+    // the oldest line is dropped when full
+    if (history.size() == history_ring::MAX_LINES && history_stale > 0) {
+        history_stale--;
+    }
+    return history.PushBack(width);
+}
+
+void terminal_context::ReflowScreen(int new_term_row, int new_term_col) {
+    // while on the alternate screen, the cursor of the normal screen is the one saved by 1049
+    term_grid &grid = alternate_screen ? alt_buffer : buffer;
+    int cursor_row = std::min(alternate_screen ? save_row : row, grid.size() - 1);
+    int cursor_col = alternate_screen ? save_col : col;
+    // a cursor saved by DECSC on the normal screen moves with its content too
+    int saved_row = alternate_screen ? -1 : std::min(save_row, grid.size() - 1);
+
+    // rows with content, at least up to the cursors
+    int last = std::max(cursor_row, saved_row);
+    for (int i = grid.size() - 1; i > last; i--) {
+        const_term_row line = grid[i];
+        if (grid.Wrapped(i) ||
+            std::any_of(line.begin(), line.end(), [](term_char c) { return c.code != ' ' || c.style_id != 0; })) {
+            last = i;
+            break;
+        }
+    }
+
+    // the first row may continue a line in history, take up to a screenful of its chars back so that the line is
+    // rewrapped as one, an older part stays stale and is split off, so resizing costs the same with any history;
+    // the split is counted in chars, not rows or cells, so it lands at the same place however history was laid out
+    size_t first = history.size();
+    size_t budget = (size_t)new_term_row * new_term_col, taken = 0;
+    int cut = -1;
+    while (last >= 0 && first > 0 && history[first - 1].wrapped) {
+        const history_line &prev = history[first - 1];
+        int length = JoinedLength(prev.cells, prev.padded, prev.split);
+        size_t chars = std::count_if(prev.cells.begin(), prev.cells.begin() + length,
+                                     [](term_char c) { return c.code != term_char::WIDE_TAIL; });
+        if (taken + chars > budget) {
+            // cells from cut on are taken, a wide char together with its tail
+            cut = length;
+            for (size_t wanted = budget - taken; wanted > 0;) {
+                if (prev.cells[--cut].code != term_char::WIDE_TAIL) {
+                    wanted--;
+                }
+            }
+            break;
+        }
+        taken += chars;
+        first--;
+    }
+
+    // join soft-wrapped rows into logical lines and lay them out again
+    reflow_writer writer(new_term_col);
+    std::vector<term_char> line;
+    int line_cursor = -1, line_saved = -1;
+    if (cut >= 0) {
+        const history_line &prev = history[first - 1];
+        line.insert(line.end(), prev.cells.begin() + cut,
+                    prev.cells.begin() + JoinedLength(prev.cells, prev.padded, prev.split));
+    }
+    for (size_t i = first; i < history.size(); i++) {
+        JoinRow(line, history[i].cells, history[i].padded, history[i].split);
+    }
+    for (int i = 0; i <= last; i++) {
+        if (i == cursor_row) {
+            line_cursor = (int)line.size() + std::min(cursor_col, grid[i].size());
+        }
+        if (i == saved_row) {
+            line_saved = (int)line.size() + std::min(save_col, grid[i].size());
+        }
+        JoinRow(line, grid[i], grid.Padded(i));
+        if (!grid.Wrapped(i) || i == last) {
+            writer.AddLine(line, grid.Wrapped(i), line_cursor, line_saved);
+            line.clear();
+            line_cursor = -1;
+            line_saved = -1;
+        }
+    }
+    history.Erase(first, history.size());
+    history_stale = std::min(history_stale, first);
+    if (first > 0 && history[first - 1].wrapped) {
+        history_line &prev = history[first - 1];
+        if (cut >= 0) {
+            std::fill(prev.cells.begin() + cut, prev.cells.end(), term_char());
+            prev.padded = false;
+            prev.shared.reset();
+        }
+        prev.split = true;
+    }
+
+    // keep the bottom rows and the cursor on screen, the rest scrolls into history
+    int num_lines = writer.rows.size();
+    int top = std::max(num_lines - new_term_row, 0);
+    if (writer.cursor.row >= 0 && writer.cursor.row < top) {
+        top = writer.cursor.row;
+    }
+    // rows of the normal screen, which is saved in alt_buffer while the alternate one is shown
+    assert(&grid == (alternate_screen ? &alt_buffer : &buffer));
+    for (int i = 0; i < top; i++) {
+        history_line &line = PushHistory(new_term_col);
+        std::copy(writer.rows[i].cells.begin(), writer.rows[i].cells.end(), line.cells.begin());
+        line.wrapped = writer.rows[i].wrapped;
+        line.padded = writer.rows[i].padded;
+    }
+    grid.Resize(new_term_row, new_term_col);
+    for (int i = 0; i < new_term_row; i++) {
+        if (top + i < num_lines) {
+            std::copy(writer.rows[top + i].cells.begin(), writer.rows[top + i].cells.end(), grid[i].begin());
+            grid.SetWrapped(i, writer.rows[top + i].wrapped, writer.rows[top + i].padded);
+        } else {
+            grid.ClearRow(i, term_char());
+        }
+    }
+    if (writer.cursor.row >= 0 && alternate_screen) {
+        save_row = writer.cursor.row - top;
+        save_col = writer.cursor.col;
+    } else if (writer.cursor.row >= 0) {
+        row = writer.cursor.row - top;
+        col = writer.cursor.col;
+    }
+    if (writer.saved.row >= 0) {
+        // a saved cursor scrolled into history stays on the top row
+        save_row = std::max(writer.saved.row - top, 0);
+        save_col = writer.saved.col;
+    }
+}
+
+void terminal_context::ReflowHistory(size_t lines) {
+    if (history_stale == 0 || history.size() - history_stale >= lines) {
+        return;
+    }
+
+    // reflow a screenful more, so that scrolling up splices history once per page
+    size_t needed = lines + num_rows - (history.size() - history_stale);
+    std::vector<std::vector<history_line>> reflowed;
+    size_t begin = history_stale, num_reflowed = 0;
+    std::vector<term_char> line;
+    while (begin > 0 && num_reflowed < needed) {
+        // logical line ending before begin, or the part of it before a split,
+        // ReflowScreen() keeps lines from continuing past history_stale unless split there
+        size_t end = begin;
+        begin--;
+        while (begin > 0 && history[begin - 1].wrapped && !history[begin - 1].split) {
+            begin--;
+        }
+        line.clear();
+        for (size_t i = begin; i < end; i++) {
+            JoinRow(line, history[i].cells, history[i].padded, history[i].split);
+        }
+        reflow_writer writer(num_cols);
+        writer.AddLine(line, history[end - 1].wrapped, -1, -1);
+        writer.rows.back().split = history[end - 1].split;
+        num_reflowed += writer.rows.size();
+        reflowed.push_back(std::move(writer.rows));
+    }
+
+    // lines were reflowed bottom up
+    std::vector<history_line> rows;
+    rows.reserve(num_reflowed);
+    for (auto it = reflowed.rbegin(); it != reflowed.rend(); ++it) {
+        std::move(it->begin(), it->end(), std::back_inserter(rows));
+    }
+    history.Erase(begin, history_stale);
+    // narrower lines may exceed the limit, which drops the oldest
+    history_stale = history.Insert(begin, rows);
+}
+
+void terminal_context::SwitchScreen(bool alternate) {
+    if (alternate != alternate_screen) {
+        // grids have the same size, swapping moves no cells
+        std::swap(buffer, alt_buffer);
+        alternate_screen = alternate;
+        damage.AddRows(0, num_rows, num_cols);
+    }
+}
+
+static int char_width(uint32_t codepoint, const uint16_t *width_index) {
+    // printable ascii are always single width
+    if (codepoint >= 0x20 && codepoint < 0x7f) {
+        return 1;
+    }
+#ifdef HAVE_WIDTH_TABLE
+    if (codepoint < WIDTH_TABLE_SIZE) {
+        return width_blocks[width_index[codepoint >> WIDTH_BLOCK_SHIFT] << WIDTH_BLOCK_SHIFT |
+                            (codepoint & WIDTH_BLOCK_MASK)];
+    }
+    return 0;
+#else
+    return std::max(utf8proc_charwidth(codepoint), 0);
+#endif
+}
+
+terminal_context::terminal_context() { SetAmbiguousWide(false); }
+
+void terminal_context::SetAmbiguousWide(bool wide) {
+#ifdef HAVE_WIDTH_TABLE
+    width_index = wide ? width_index_wide : width_index_narrow;
+#else
+    // utf8proc_charwidth always treats ambiguous characters as narrow
+    (void)wide;
+#endif
+}
+
+int terminal_context::CharWidth(uint32_t codepoint) const { return char_width(codepoint, width_index); }
+
+// number of cells occupied by the codepoint
+static int cell_width(uint32_t codepoint, const uint16_t *width_index) {
+    int cw = char_width(codepoint, width_index);
+    // don't insert zero-width characters
+    if (cw <= 0) return 0;
+    // 3-width character is rare and unsupported by default font
+    if (cw > 2) return 2;
+    return cw;
+}
+
+// IRM: move characters from cursor rightward by count columns
+void terminal_context::ShiftRight(int count) {
+    if (col + count < num_cols) {
+        buffer.Move(row, col, num_cols - count, col + count);
+        damage.Add(row, col, num_cols);
+    }
+}
+
+uint32_t grapheme_table::Intern(const std::vector<uint32_t> &cluster) {
+    auto it = codes.find(cluster);
+    if (it != codes.end()) {
+        return it->second;
+    }
+
+    uint32_t index;
+    interns_since_sweep++;
+    if (!free_list.empty()) {
+        index = free_list.back();
+        free_list.pop_back();
+        clusters[index] = cluster;
+    } else if (clusters.size() < MAX_CLUSTERS) {
+        index = clusters.size();
+        clusters.push_back(cluster);
+    } else {
+        return 0;
+    }
+    uint32_t code = term_char::CLUSTER_BASE + index;
+    codes[cluster] = code;
+    version++;
+    return code;
+}
+
+const uint32_t *grapheme_table::Resolve(const std::vector<std::vector<uint32_t>> &clusters, const uint32_t &code,
+                                        size_t &length) {
+    if (IsCluster(code)) {
+        uint32_t index = code - term_char::CLUSTER_BASE;
+        if (index < clusters.size() && !clusters[index].empty()) {
+            length = clusters[index].size();
+            return clusters[index].data();
+        }
+    }
+    length = 1;
+    return &code;
+}
+
+void grapheme_table::Sweep(const std::vector<bool> &used) {
+    for (uint32_t index = 0; index < clusters.size(); index++) {
+        if (!used[index] && !clusters[index].empty()) {
+            codes.erase(clusters[index]);
+            clusters[index].clear();
+            clusters[index].shrink_to_fit();
+            free_list.push_back(index);
+        }
+    }
+    interns_since_sweep = 0;
+}
+
+void terminal_context::CollectGraphemes() {
+    std::vector<bool> used(graphemes.clusters.size());
+    auto mark = [&](const_term_row line) {
+        for (auto &c : line) {
+            if (grapheme_table::IsCluster(c.code) && c.code - term_char::CLUSTER_BASE < used.size()) {
+                used[c.code - term_char::CLUSTER_BASE] = true;
+            }
+        }
+    };
+    for (size_t i = 0; i < history.size(); i++) {
+        mark(history[i].cells);
+    }
+    for (int i = 0; i < buffer.size(); i++) {
+        mark(buffer[i]);
+        mark(alt_buffer[i]);
+    }
+    graphemes.Sweep(used);
+}
+
+style_table::style_table() {
+    styles.push_back(term_style());
+    ids[Key(styles[0])] = 0;
+}
+
+uint32_t style_table::Intern(const term_style &style) {
+    auto key = Key(style);
+    auto it = ids.find(key);
+    if (it != ids.end()) {
+        return it->second;
+    }
+
+    uint32_t id;
+    interns_since_sweep++;
+    if (!free_list.empty()) {
+        id = free_list.back();
+        free_list.pop_back();
+        styles[id] = style;
+    } else if (styles.size() < MAX_STYLES) {
+        id = styles.size();
+        styles.push_back(style);
+    } else {
+        return 0;
+    }
+    ids[key] = id;
+    version++;
+    return id;
+}
+
+void style_table::Sweep(const std::vector<bool> &used) {
+    // the default style is never freed
+    for (uint32_t id = 1; id < styles.size(); id++) {
+        if (used[id]) {
+            continue;
+        }
+        auto it = ids.find(Key(styles[id]));
+        // a freed id is stale and not in ids
+        if (it != ids.end() && it->second == id) {
+            ids.erase(it);
+            free_list.push_back(id);
+        }
+    }
+    interns_since_sweep = 0;
+}
+
+void terminal_context::InternCurrentStyle() {
+    current_style_id = InternStyle(current_style);
+    interned_style = current_style;
+}
+
+void terminal_context::InternBlank() {
+    // xterm keeps only the background color in erased cells
+    term_style style;
+    style.back = current_style.back;
+    blank.style_id = InternStyle(style);
+    blank_back = current_style.back;
+}
+
+uint32_t terminal_context::InternStyle(const term_style &style) {
+    uint32_t id = styles.Intern(style);
+    if (id == 0 && !(style == styles.Get(0)) && styles.SweepDue()) {
+        // table is full, reclaim styles that have scrolled out
+        CollectStyles();
+        id = styles.Intern(style);
+    }
+    return id;
+}
+
+void terminal_context::CollectStyles() {
+    std::vector<bool> used(styles.styles.size());
+    auto mark = [&](const_term_row line) {
+        for (auto &c : line) {
+            used[c.style_id] = true;
+        }
+    };
+    for (size_t i = 0; i < history.size(); i++) {
+        mark(history[i].cells);
+    }
+    for (int i = 0; i < buffer.size(); i++) {
+        mark(buffer[i]);
+        mark(alt_buffer[i]);
+    }
+    used[current_style_id] = true;
+    used[blank.style_id] = true;
+    styles.Sweep(used);
+}
+
+// zero width codepoints that belong to the previous character
+static bool IsCombining(uint32_t codepoint) {
+    switch (utf8proc_category(codepoint)) {
+    case UTF8PROC_CATEGORY_MN:
+    case UTF8PROC_CATEGORY_MC:
+    case UTF8PROC_CATEGORY_ME:
+        return true;
+    default:
+        // ZWJ and emoji tag sequences
+        return codepoint == 0x200d || (codepoint >= 0xe0020 && codepoint <= 0xe007f);
+    }
+}
+
+static bool IsRegionalIndicator(uint32_t codepoint) { return codepoint >= 0x1f1e6 && codepoint <= 0x1f1ff; }
+
+static bool IsEmojiModifier(uint32_t codepoint) { return codepoint >= 0x1f3fb && codepoint <= 0x1f3ff; }
+
+// codepoints that may join the previous cell instead of starting a new one
+static bool MayCombine(uint32_t codepoint, int cw) {
+    return cw == 0 || IsRegionalIndicator(codepoint) || IsEmojiModifier(codepoint);
+}
+
+bool terminal_context::Combine(uint32_t codepoint, int cw) {
+    // find the previous character, skipping the tail of a wide char
+    int prev = col - 1;
+    if (prev > 0 && buffer[row][prev].code == term_char::WIDE_TAIL) {
+        prev--;
+    }
+    if (prev < 0 || buffer[row][prev].code == term_char::WIDE_TAIL) {
+        // nothing to attach to, drop zero width codepoints
+        return cw == 0;
+    }
+    term_char &base = buffer[row][prev];
+    size_t length;
+    const uint32_t *codepoints = graphemes.Resolve(base.code, length);
+
+    if (cw == 0) {
+        if (!IsCombining(codepoint)) {
+            return true;
+        }
+    } else if (codepoint < 0x80) {
+        return false;
+    } else if (codepoints[length - 1] == 0x200d) {
+        // joined by ZWJ
+    } else if (IsEmojiModifier(codepoint)) {
+        // emoji modifier follows a wide emoji
+        if (prev + 1 >= num_cols || buffer[row][prev + 1].code != term_char::WIDE_TAIL) {
+            return false;
+        }
+    } else if (IsRegionalIndicator(codepoint)) {
+        // pair of regional indicators forms a flag
+        if (length != 1 || !IsRegionalIndicator(codepoints[0])) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    if (length >= grapheme_table::MAX_CLUSTER_LENGTH) {
+        return true;
+    }
+    std::vector<uint32_t> cluster(codepoints, codepoints + length);
+    cluster.push_back(codepoint);
+    uint32_t code = graphemes.Intern(cluster);
+    if (code == 0 && graphemes.SweepDue()) {
+        // table is full, reclaim clusters that have scrolled out
+        CollectGraphemes();
+        code = graphemes.Intern(cluster);
+    }
+    if (code != 0) {
+        base.code = code;
+        damage.Add(row, prev, prev + 1);
+    }
+    return true;
+}
+
+std::string terminal_context::LineText(const_term_row line) const {
+    std::string text;
+    for (auto &c : line) {
+        if (c.code == term_char::WIDE_TAIL) {
+            continue;
+        }
+        size_t length;
+        const uint32_t *codepoints = graphemes.Resolve(c.code, length);
+        for (size_t i = 0; i < length; i++) {
+            uint8_t temp[4];
+            utf8proc_ssize_t size = utf8proc_encode_char(codepoints[i], temp);
+            text.append((const char *)temp, size);
+        }
+    }
+    return text;
 }
 
 void terminal_context::InsertUtf8(uint32_t codepoint) {
     assert(row >= 0 && row < num_rows);
     assert(col >= 0 && col <= num_cols);
 
-    int cw = char_width(codepoint);
-    // don't insert zero-width characters
-    if (cw <= 0) return;
-    // 3-width character is rare and unsupported by default font
-    if (cw > 2) cw = 2;
+    int cw = cell_width(codepoint, width_index);
+    if (codepoint >= 0x80 && Combine(codepoint, cw)) {
+        return;
+    }
+    if (cw == 0) return;
 
     // can fit if just equal num_cols
     if (col + cw > num_cols) {
         if (enable_wrap) {
-            // wrap to next line
+            // wrap to next line, remembered so that resize can rejoin it,
+            // a wide char that did not fit leaves a padding cell behind
+            buffer.SetWrapped(row, true, col < num_cols);
             row ++;
             col = 0;
             DropFirstRowIfOverflow();
         } else {
             // remove tail chars until fit
-            col = num_cols - cw;
+            col = std::max(num_cols - cw, 0);
             // remove a broken wide char
-            while (buffer[row][col].code == term_char::WIDE_TAIL)
+            while (col > 0 && buffer[row][col].code == term_char::WIDE_TAIL)
                 col --;
         }
     }
+    if (insert_mode) {
+        ShiftRight(cw);
+    }
+    last_codepoint = codepoint;
+    damage.Add(row, col, std::min(col + cw, num_cols));
     if (cw > 1) {
         // place the wide char
         buffer[row][col].code = codepoint;
-        buffer[row][col++].style = current_style;
+        buffer[row][col++].style_id = CurrentStyleId();
         // if spacer can't be inserted
         if (col == num_cols) return;
         codepoint = term_char::WIDE_TAIL;
     }
     buffer[row][col].code = codepoint;
-    buffer[row][col++].style = current_style;
+    buffer[row][col++].style_id = CurrentStyleId();
+}
+
+void terminal_context::InsertPrintable(const uint8_t *data, size_t length) {
+    while (length > 0) {
+        if (col >= num_cols) {
+            // wrapping is handled per character
+            InsertUtf8(*data++);
+            length--;
+            continue;
+        }
+
+        // printable ascii are always single width, copy as many as fit in the row
+        size_t count = std::min(length, (size_t)(num_cols - col));
+        if (insert_mode) {
+            ShiftRight(count);
+        }
+        damage.Add(row, col, col + count);
+        term_char *dest = &buffer[row][col];
+        uint32_t style_id = CurrentStyleId();
+        for (size_t i = 0; i < count; i++) {
+            dest[i].code = data[i];
+            dest[i].style_id = style_id;
+        }
+        last_codepoint = data[count - 1];
+        col += count;
+        data += count;
+        length -= count;
+    }
+}
+
+void terminal_context::InsertCodepoints(const uint32_t *codepoints, size_t length) {
+    size_t begin = 0;
+    while (begin < length) {
+        // find the run of characters that fit in the current row
+        int width = 0;
+        size_t end = begin;
+        while (end < length) {
+            int cw = cell_width(codepoints[end], width_index);
+            if (col + width + cw > num_cols || MayCombine(codepoints[end], cw)) {
+                break;
+            }
+            width += cw;
+            end++;
+        }
+        // a grapheme cluster before cursor may continue after ZWJ
+        int prev = col > 1 && buffer[row][col - 1].code == term_char::WIDE_TAIL ? col - 2 : col - 1;
+        if (end == begin || (prev >= 0 && grapheme_table::IsCluster(buffer[row][prev].code))) {
+            // wrapping, truncation and grapheme clusters are handled per character
+            InsertUtf8(codepoints[begin++]);
+            continue;
+        }
+
+        // shift once for the whole run, then fill
+        if (insert_mode) {
+            ShiftRight(width);
+        }
+        damage.Add(row, col, col + width);
+        term_char *dest = &buffer[row][col];
+        uint32_t style_id = CurrentStyleId();
+        for (size_t i = begin; i < end; i++) {
+            int cw = cell_width(codepoints[i], width_index);
+            dest->code = codepoints[i];
+            dest->style_id = style_id;
+            dest++;
+            if (cw > 1) {
+                dest->code = term_char::WIDE_TAIL;
+                dest->style_id = style_id;
+                dest++;
+            }
+        }
+        last_codepoint = codepoints[end - 1];
+        col += width;
+        begin = end;
+    }
+}
+
+void terminal_context::Repeat(int count) {
+    if (last_codepoint == 0) {
+        return;
+    }
+    bool narrow = cell_width(last_codepoint, width_index) == 1;
+    while (count > 0) {
+        if (!narrow || col >= num_cols) {
+            // wrapping and wide chars are handled per character
+            InsertUtf8(last_codepoint);
+            count--;
+            continue;
+        }
+        int n = std::min(count, num_cols - col);
+        if (insert_mode) {
+            ShiftRight(n);
+        }
+        term_char c;
+        c.code = last_codepoint;
+        c.style_id = CurrentStyleId();
+        buffer.Fill(row, col, col + n, c);
+        damage.Add(row, col, col + n);
+        col += n;
+        count -= n;
+    }
+}
+
+bool terminal_context::GetRect(const csi_params &csi, int index, int &top, int &left, int &bottom, int &right) {
+    // zero is the same as omitted
+    auto get = [&](int i, int def) {
+        int value = csi.Get(index + i, def);
+        return value == 0 ? def : value;
+    };
+    int base = origin_mode ? scroll_top : 0;
+    int limit = origin_mode ? scroll_bottom + 1 : num_rows;
+    top = std::min(base + get(0, 1) - 1, limit);
+    left = std::min(get(1, 1) - 1, num_cols);
+    bottom = std::min(base + get(2, limit - base), limit);
+    right = std::min(get(3, num_cols), num_cols);
+    return top < bottom && left < right;
 }
 
 // clamp cursor to valid range
@@ -336,826 +1301,1645 @@ void terminal_context::WriteFull(uint8_t *data, size_t length) {
     }
 }
 
-// CAUTION: clobbers temp
-#define read_int_or_default(def)                                                                                       \
-    (temp = 0, (escape_buffer != "" ? sscanf(escape_buffer.c_str(), "%d", &temp) : temp = (def)), temp)
+void csi_params::Clear() {
+    count = 0;
+    sub_mask = 0;
+    private_marker = 0;
+    num_intermediates = 0;
+    length = 0;
+    // zero padding of the first 16 bytes is used by sgr_cache
+    memset(raw, 0, 16);
+    current = -1;
+    next_sub = false;
+    has_params = false;
+    malformed = false;
+}
 
-// handle CSI escape sequences
-void terminal_context::HandleCSI(uint8_t current) {
-    int temp = 0;
-    if (current >= 0x40 && current <= 0x7E) {
-        // final byte in [0x40, 0x7E]
-        if (current == 'A') {
-            // CSI Ps A, CUU, move cursor up # lines
-            int line = read_int_or_default(1);
-            if (row >= scroll_top) {
-                // do not move past scrolling margin
-                MoveCursor(-std::min(line, row - scroll_top), 0);
-            } else {
-                // we are out of scrolling region, move nevertheless
-                MoveCursor(-line, 0);
+void csi_params::Push() {
+    if (count < MAX_PARAMS) {
+        params[count] = current;
+        if (next_sub) {
+            sub_mask |= 1u << count;
+        }
+        count++;
+    }
+    current = -1;
+    next_sub = false;
+}
+
+void csi_params::Put(uint8_t byte) {
+    bool first = length == 0;
+    // keep a truncated copy for logging
+    if (length < MAX_RAW) {
+        raw[length] = byte;
+        raw[length + 1] = '\0';
+    }
+    length++;
+
+    if (byte >= '0' && byte <= '9') {
+        // parameters after intermediates are invalid
+        if (num_intermediates > 0) {
+            malformed = true;
+        }
+        has_params = true;
+        if (current < 0) {
+            current = 0;
+        }
+        current = std::min(current * 10 + (byte - '0'), MAX_VALUE);
+    } else if (byte == ';' || byte == ':') {
+        if (num_intermediates > 0) {
+            malformed = true;
+        }
+        has_params = true;
+        Push();
+        // ':' separates sub-parameters, e.g. CSI 38 : 2 : r : g : b m
+        next_sub = byte == ':';
+    } else if (byte >= '<' && byte <= '?') {
+        // private marker is only allowed as the first byte
+        if (first) {
+            private_marker = byte;
+        } else {
+            malformed = true;
+        }
+    } else {
+        // intermediate bytes in [0x20, 0x2F]
+        if (num_intermediates < MAX_INTERMEDIATES) {
+            intermediates[num_intermediates++] = byte;
+        } else {
+            malformed = true;
+        }
+    }
+}
+
+void csi_params::Finish() {
+    // push the last parameter, if any parameter byte is seen
+    if (has_params) {
+        Push();
+    }
+}
+
+sgr_cache::entry *sgr_cache::Lookup(const csi_params &csi, bool &hit) {
+    hit = false;
+    if (csi.length > csi_params::MAX_RAW) {
+        // raw bytes are truncated
+        return nullptr;
+    }
+
+    // hashing byte by byte costs about as much as SGR itself, so use the first
+    // 16 bytes as key, which are zero padded, and compare the rest on match
+    uint64_t head, tail;
+    memcpy(&head, csi.raw, 8);
+    memcpy(&tail, csi.raw + 8, 8);
+    uint64_t hash = (head ^ (tail + csi.length) * 0x9e3779b97f4a7c15ull) * 0x9e3779b97f4a7c15ull;
+
+    entry *set = &entries[(hash >> 32) % NUM_SETS * NUM_WAYS];
+    for (int way = 0; way < NUM_WAYS; way++) {
+        entry &e = set[way];
+        if (e.valid && e.head == head && e.tail == tail && e.length == csi.length &&
+            (csi.length <= 16 || memcmp(e.rest, csi.raw + 16, csi.length - 16) == 0)) {
+            hits++;
+            hit = true;
+            if (way > 0) {
+                std::rotate(set, set + way, set + way + 1);
             }
-        } else if (current == 'B') {
-            // CSI Ps B, CUD, move cursor down # lines
-            int line = read_int_or_default(1);
-            if (row <= scroll_bottom) {
-                // do not move past scrolling margin
-                MoveCursor(std::min(line, scroll_bottom - row), 0);
-            } else {
-                // we are out of scrolling region, move nevertheless
-                MoveCursor(line,  0);
+            return &set[0];
+        }
+    }
+
+    // evict the least recently used
+    misses++;
+    std::rotate(set, set + NUM_WAYS - 1, set + NUM_WAYS);
+    set[0].valid = true;
+    set[0].head = head;
+    set[0].tail = tail;
+    set[0].length = csi.length;
+    if (csi.length > 16) {
+        memcpy(set[0].rest, csi.raw + 16, csi.length - 16);
+    }
+    return &set[0];
+}
+
+// CSI Pm m, Character Attributes (SGR)
+void terminal_context::HandleSGR(const csi_params &csi, term_style &style, bool warn) {
+    // set color
+    // CSI m is the same as CSI 0 m
+    int count = std::max(csi.count, 1);
+    for (int i = 0; i < count; i++) {
+        if (csi.IsSub(i)) {
+            // unsupported sub-parameter, e.g. CSI 4 : 3 m
+            continue;
+        }
+        int param = csi.Get(i, 0);
+        if (param == 0) {
+            // reset all attributes to their defaults
+            style = term_style();
+        } else if (param == 1) {
+            // set bold, CSI 1 m
+            style.type = font_class::bold;
+        } else if (param == 2) {
+            // set faint, CSI 2 m
+            style.faint = true;
+        } else if (param == 4) {
+            // set underline, CSI 4 m
+            // underline style, CSI 4 : Ps m, further sub-parameters are skipped
+            style.underline = term_style::underline_single;
+            if (i + 1 < csi.count && csi.IsSub(i + 1)) {
+                int kind = csi.Get(++i, 0);
+                if (kind < term_style::NUM_UNDERLINE_STYLE) {
+                    style.underline = (term_style::underline_style)kind;
+                }
             }
-        } else if (current == 'C') {
-            // CSI Ps C, CUF, move cursor right # columns
-            col += std::max(read_int_or_default(1), 1);
-            ClampCursor();
-        } else if (current == 'D') {
-            // CSI Ps D, CUB, move cursor left # columns
-            col -= std::max(read_int_or_default(1), 1);
-            ClampCursor();
-        } else if (current == 'E') {
-            // CSI Ps E, CNL, move cursor to the beginning of next line, down # lines
-            row += read_int_or_default(1);
-            col = 0;
-            ClampCursor();
-        } else if (current == 'F') {
-            // CSI Ps F, CPL, move cursor to the beginning of previous line, up # lines
-            row -= read_int_or_default(1);
-            col = 0;
-            ClampCursor();
-        } else if (current == 'G') {
-            // CSI Ps G, CHA, move cursor to column #
-            col = read_int_or_default(1);
-            // convert from 1-based to 0-based
-            col--;
-            ClampCursor();
-        } else if (current == 'H') {
-            std::vector<std::string> parts = SplitString(escape_buffer, ";");
-            if (parts.size() == 2) {
-                // CSI Ps ; PS H, CUP, move cursor to x, y
-                sscanf(parts[0].c_str(), "%d", &row);
-                sscanf(parts[1].c_str(), "%d", &col);
-                // convert from 1-based to 0-based
-                row--;
-                col--;
-                ClampCursor();
-            } else if (parts.size() == 1 && escape_buffer != "") {
-                // CSI Ps H, CUP, move cursor to x, y, col is 0
-                sscanf(parts[0].c_str(), "%d", &row);
-                col = 0;
-                // convert from 1-based to 0-based
-                row--;
-                ClampCursor();
-            } else if (escape_buffer == "") {
-                // CSI H, HOME, move cursor upper left corner
-                row = col = 0;
-            } else {
-                goto unknown;
+        } else if (param == 5 || param == 6) {
+            // set slowly blink, CSI 5 m
+            // set rapidly blink, CSI 6 m
+            style.blink = true;
+        } else if (param == 7) {
+            // inverse, flip foreground and background color, CSI 7 m
+            std::swap(style.fore, style.back);
+        } else if (param == 9) {
+            // set strikethrough, CSI 9 m
+            style.strikethrough = true;
+        } else if (param == 10) {
+            // reset to primary font, CSI 10 m
+            style = term_style();
+        } else if (param == 21) {
+            // set doubly underlined, CSI 21 m
+            style.underline = term_style::underline_double;
+        } else if (param == 22) {
+            // set not bold faint, CSI 22 m
+            style.type = font_class::regular;
+            style.faint = false;
+        } else if (param == 24) {
+            // set not underlined, CSI 24 m
+            style.underline = term_style::underline_none;
+        } else if (param == 25) {
+            // set steady (not blinking), CSI 25 m
+            style.blink = false;
+        } else if (param == 27) {
+            // set positive (not inverse), CSI 27 m
+            std::swap(style.fore, style.back);
+        } else if (param == 29) {
+            // set not crossed-out, CSI 29 m
+            style.strikethrough = false;
+        } else if (30 <= param && param <= 37) {
+            // foreground ansi 0..7
+            style.fore = term_style::color::Palette(param - 30);
+        } else if (param == 38 || param == 48 || param == 58) {
+            // foreground color: extended color, CSI 38 ; ... m or CSI 38 : ... m
+            // background color: extended color, CSI 48 ; ... m or CSI 48 : ... m
+            // underline color: extended color, CSI 58 ; ... m or CSI 58 : ... m
+            term_style::color &target = param == 38 ? style.fore : param == 48 ? style.back : style.underline_color;
+            int subs = 0;
+            while (i + 1 + subs < csi.count && csi.IsSub(i + 1 + subs)) {
+                subs++;
             }
-        } else if (current == 'J') {
-            // CSI Ps J, ED, erase in display
-            if (escape_buffer == "" || escape_buffer == "0") {
-                // CSI J, CSI 0 J
-                // erase below
-                for (int i = col; i < num_cols; i++) {
-                    buffer[row][i] = term_char();
-                }
-                for (int i = row + 1; i < num_rows; i++) {
-                    std::fill(buffer[i].begin(), buffer[i].end(), term_char());
+            if (subs > 0) {
+                // CSI 38 : 5 : index m
+                // CSI 38 : 2 : [colorspace] : r : g : b m
+                int color_type = csi.Get(i + 1, 0);
+                if (color_type == 5 && subs >= 2) {
+                    target = term_style::color::Palette(csi.Get(i + 2, 0));
+                } else if (color_type == 2 && subs >= 4) {
+                    int first = subs >= 5 ? i + 3 : i + 2;
+                    target.set_rgb(csi.Get(first, 0), csi.Get(first + 1, 0), csi.Get(first + 2, 0));
                 }
-            } else if (escape_buffer == "1") {
-                // CSI 1 J
-                // erase above
-                for (int i = 0; i < row; i++) {
-                    std::fill(buffer[i].begin(), buffer[i].end(), term_char());
+                i += subs;
+            } else if (i + 1 < csi.count) {
+                int color_type = csi.Get(++i, 0);
+                if (color_type == 5 && i + 1 < csi.count) { // 256-color mode
+                    // specified color index
+                    target = term_style::color::Palette(csi.Get(++i, 0));
+                } else if (color_type == 2 && i + 3 < csi.count) { // RGB mode
+                    // specified rgb
+                    int r = csi.Get(++i, 0);
+                    int g = csi.Get(++i, 0);
+                    int b = csi.Get(++i, 0);
+                    target.set_rgb(r, g, b);
                 }
-                for (int i = 0; i <= col; i++) {
-                    buffer[row][i] = term_char();
-                }
-            } else if (escape_buffer == "2") {
-                // CSI 2 J
-                // erase all
-                for (int i = 0; i < num_rows; i++) {
-                    std::fill(buffer[i].begin(), buffer[i].end(), term_char());
-                }
-            } else {
-                goto unknown;
             }
-        } else if (current == 'K') {
-            // CSI Ps K, EL, erase in line
-            if (escape_buffer == "" || escape_buffer == "0") {
-                // CSI K, CSI 0 K
-                // erase to right
-                for (int i = col; i < num_cols; i++) {
-                    buffer[row][i] = term_char();
-                }
-            } else if (escape_buffer == "1") {
-                // CSI 1 K
-                // erase to left
-                for (int i = 0; i <= col && i < num_cols; i++) {
-                    buffer[row][i] = term_char();
-                }
-            } else if (escape_buffer == "2") {
-                // CSI 2 K
-                // erase whole line
-                for (int i = 0; i < num_cols; i++) {
-                    buffer[row][i] = term_char();
-                }
-            } else {
-                goto unknown;
+        } else if (param == 39) {
+            // default foreground
+            style.fore = term_style::color::DefaultFore();
+        } else if (40 <= param && param <= 47) {
+            // background ansi 0..7
+            style.back = term_style::color::Palette(param - 40);
+        } else if (param == 49) {
+            // default background
+            style.back = term_style::color::DefaultBack();
+        } else if (param == 59) {
+            // default underline color, follows the text
+            style.underline_color = term_style::color::DefaultFore();
+        } else if (90 <= param && param <= 97) {
+            // foreground ansi 8..15
+            style.fore = term_style::color::Palette(8 + param - 90);
+        } else if (100 <= param && param <= 107) {
+            // background ansi 8..15
+            style.back = term_style::color::Palette(8 + param - 100);
+        } else if (warn) {
+            LOG_WARN("Unknown CSI Pm m: %d from %s m",
+                        param, csi.raw);
+        }
+    }
+}
+
+// derive the delta of a SGR sequence by applying it to probe styles
+// probe colors have a high byte beyond any color_tag, which SGR never produces
+sgr_delta terminal_context::SGRDelta(const csi_params &csi) {
+    const uint32_t probe_fore = 0xfe000000, probe_back = 0xff000000, probe_underline = 0xfd000000;
+    term_style probe[2];
+    for (int i = 0; i < 2; i++) {
+        probe[i].fore = probe_fore;
+        probe[i].back = probe_back;
+        probe[i].type = NUM_FONT_CLASS;
+        probe[i].blink = i == 1;
+        probe[i].underline = term_style::NUM_UNDERLINE_STYLE;
+        probe[i].strikethrough = i == 1;
+        probe[i].faint = i == 1;
+        probe[i].underline_color = probe_underline;
+        HandleSGR(csi, probe[i], i == 0);
+    }
+
+    sgr_delta delta;
+    auto source = [&](term_style::color color) {
+        return color.value == probe_fore   ? sgr_delta::from_fore
+               : color.value == probe_back ? sgr_delta::from_back
+                                           : sgr_delta::from_constant;
+    };
+    delta.fore_source = source(probe[0].fore);
+    delta.back_source = source(probe[0].back);
+    delta.fore = probe[0].fore;
+    delta.back = probe[0].back;
+    delta.keep_type = probe[0].type == NUM_FONT_CLASS;
+    delta.type = probe[0].type;
+    delta.keep_blink = probe[0].blink != probe[1].blink;
+    delta.blink = probe[0].blink;
+    delta.keep_underline = probe[0].underline == term_style::NUM_UNDERLINE_STYLE;
+    delta.underline = probe[0].underline;
+    delta.keep_strikethrough = probe[0].strikethrough != probe[1].strikethrough;
+    delta.strikethrough = probe[0].strikethrough;
+    delta.keep_faint = probe[0].faint != probe[1].faint;
+    delta.faint = probe[0].faint;
+    delta.keep_underline_color = probe[0].underline_color.value == probe_underline;
+    delta.underline_color = probe[0].underline_color;
+    return delta;
+}
+
+// handle CSI escape sequences, current is the final byte in [0x40, 0x7E]
+void terminal_context::HandleCSI(const csi_params &csi, uint8_t current) {
+    // no private marker or intermediate bytes
+    bool plain = csi.private_marker == 0 && csi.num_intermediates == 0;
+    // rectangular area operations have a single $ intermediate
+    bool rect = csi.private_marker == 0 && csi.num_intermediates == 1 && csi.intermediates[0] == '$';
+    if (csi.malformed) {
+        goto unknown;
+    } else if (current == 'A' && plain) {
+        // CSI Ps A, CUU, move cursor up # lines
+        int line = csi.Get(0, 1);
+        if (row >= scroll_top) {
+            // do not move past scrolling margin
+            MoveCursor(-std::min(line, row - scroll_top), 0);
+        } else {
+            // we are out of scrolling region, move nevertheless
+            MoveCursor(-line, 0);
+        }
+    } else if (current == 'B' && plain) {
+        // CSI Ps B, CUD, move cursor down # lines
+        int line = csi.Get(0, 1);
+        if (row <= scroll_bottom) {
+            // do not move past scrolling margin
+            MoveCursor(std::min(line, scroll_bottom - row), 0);
+        } else {
+            // we are out of scrolling region, move nevertheless
+            MoveCursor(line,  0);
+        }
+    } else if (current == 'C' && plain) {
+        // CSI Ps C, CUF, move cursor right # columns
+        col += std::max(csi.Get(0, 1), 1);
+        ClampCursor();
+    } else if (current == 'D' && plain) {
+        // CSI Ps D, CUB, move cursor left # columns
+        col -= std::max(csi.Get(0, 1), 1);
+        ClampCursor();
+    } else if (current == 'E' && plain) {
+        // CSI Ps E, CNL, move cursor to the beginning of next line, down # lines
+        row += csi.Get(0, 1);
+        col = 0;
+        ClampCursor();
+    } else if (current == 'F' && plain) {
+        // CSI Ps F, CPL, move cursor to the beginning of previous line, up # lines
+        row -= csi.Get(0, 1);
+        col = 0;
+        ClampCursor();
+    } else if (current == 'G' && plain) {
+        // CSI Ps G, CHA, move cursor to column #
+        col = csi.Get(0, 1);
+        // convert from 1-based to 0-based
+        col--;
+        ClampCursor();
+    } else if (current == 'H' && plain) {
+        if (csi.count > 0) {
+            // CSI Ps ; PS H, CUP, move cursor to x, y
+            // CSI Ps H, CUP, move cursor to x, y, col is 0
+            row = csi.Get(0, 1);
+            col = csi.Get(1, 1);
+            // convert from 1-based to 0-based
+            row--;
+            col--;
+            ClampCursor();
+        } else {
+            // CSI H, HOME, move cursor upper left corner
+            row = col = 0;
+        }
+    } else if (current == 'J' && plain) {
+        // CSI Ps J, ED, erase in display
+        int mode = csi.Get(0, 0);
+        if (mode == 0) {
+            // CSI J, CSI 0 J
+            // erase below
+            term_char blank = Blank();
+            buffer.Fill(row, col, num_cols, blank);
+            for (int i = row + 1; i < num_rows; i++) {
+                buffer.ClearRow(i, blank);
             }
-        } else if (current == 'L') {
-            // CSI Ps L, Insert Ps blank lines at active row
-            int line = read_int_or_default(1);
-            if (row < scroll_top || row > scroll_bottom) {
-                // outside the scroll margins, do nothing
-            } else {
-                // insert lines from current row, add new rows from scroll bottom
-                for (int i = scroll_bottom;i >= row;i --) {
-                    if (i - line >= row) {
-                        buffer[i] = buffer[i - line];
-                    } else {
-                        std::fill(buffer[i].begin(), buffer[i].end(), term_char());
-                    }
-                }
-                // set to first column
-                col = 0;
+            damage.Add(row, col, num_cols);
+            damage.AddRows(row + 1, num_rows, num_cols);
+            if (row == 0 && col == 0) {
+                UnwrapHistory();
             }
-        } else if (current == 'M') {
-            // CSI Ps M, Delete Ps lines at active row
-            int line = read_int_or_default(1);
-            if (row < scroll_top || row > scroll_bottom) {
-                // outside the scroll margins, do nothing
-            } else {
-                // delete lines from current row, add new rows from scroll bottom
-                for (int i = row;i <= scroll_bottom;i ++) {
-                    if (i + line <= scroll_bottom) {
-                        buffer[i] = buffer[i + line];
-                    } else {
-                        std::fill(buffer[i].begin(), buffer[i].end(), term_char());
-                    }
-                }
-                // set to first column
-                col = 0;
+        } else if (mode == 1) {
+            // CSI 1 J
+            // erase above
+            term_char blank = Blank();
+            for (int i = 0; i < row; i++) {
+                buffer.ClearRow(i, blank);
             }
-        } else if (current == 'P') {
-            // CSI Ps P, DCH, delete # characters, move right to left
-            int del = read_int_or_default(1);
-            for (int i = col; i < num_cols; i++) {
-                if (i + del < num_cols) {
-                    buffer[row][i] = buffer[row][i + del];
-                } else {
-                    buffer[row][i] = term_char();
-                }
+            buffer.Fill(row, 0, std::min(col + 1, num_cols), blank);
+            damage.AddRows(0, row, num_cols);
+            damage.Add(row, 0, std::min(col + 1, num_cols));
+        } else if (mode == 2) {
+            // CSI 2 J
+            // erase all
+            term_char blank = Blank();
+            for (int i = 0; i < num_rows; i++) {
+                buffer.ClearRow(i, blank);
             }
-        } else if (current == 'S') {
-            // CSI Ps S, SU, Scroll up Ps lines
-            int line = read_int_or_default(1);
-            for (int i = scroll_top; i <= scroll_bottom; i++) {
-                if (i + line <= scroll_bottom) {
-                    buffer[i] = buffer[i + line];
-                } else {
-                    std::fill(buffer[i].begin(), buffer[i].end(), term_char());
-                }
+            damage.AddRows(0, num_rows, num_cols);
+            UnwrapHistory();
+        } else {
+            goto unknown;
+        }
+    } else if (current == 'K' && plain) {
+        // CSI Ps K, EL, erase in line
+        int mode = csi.Get(0, 0);
+        if (mode == 0) {
+            // CSI K, CSI 0 K
+            // erase to right
+            buffer.Fill(row, col, num_cols, Blank());
+            damage.Add(row, col, num_cols);
+        } else if (mode == 1) {
+            // CSI 1 K
+            // erase to left
+            buffer.Fill(row, 0, std::min(col + 1, num_cols), Blank());
+            damage.Add(row, 0, std::min(col + 1, num_cols));
+        } else if (mode == 2) {
+            // CSI 2 K
+            // erase whole line
+            buffer.ClearRow(row, Blank());
+            damage.Add(row, 0, num_cols);
+        } else {
+            goto unknown;
+        }
+    } else if (current == 'L' && plain) {
+        // CSI Ps L, Insert Ps blank lines at active row
+        int line = csi.Get(0, 1);
+        if (row < scroll_top || row > scroll_bottom) {
+            // outside the scroll margins, do nothing
+        } else {
+            // insert lines from current row, drop rows at scroll bottom
+            // rotate rows instead of copying cells
+            line = std::min(line, scroll_bottom - row + 1);
+            buffer.Rotate(row, scroll_bottom + 1 - line, scroll_bottom + 1);
+            term_char blank = Blank();
+            for (int i = row;i < row + line;i ++) {
+                buffer.ClearRow(i, blank);
             }
-        } else if (current == 'X') {
-            // CSI Ps X, ECH, erase # characters, do not move others
-            int del = read_int_or_default(1);
-            for (int i = col; i < col + del && i < num_cols; i++) {
-                buffer[row][i] = term_char();
+            damage.AddRows(row, scroll_bottom + 1, num_cols);
+            // set to first column
+            col = 0;
+        }
+    } else if (current == 'M' && plain) {
+        // CSI Ps M, Delete Ps lines at active row
+        int line = csi.Get(0, 1);
+        if (row < scroll_top || row > scroll_bottom) {
+            // outside the scroll margins, do nothing
+        } else {
+            // delete lines from current row, add new rows from scroll bottom
+            line = std::min(line, scroll_bottom - row + 1);
+            buffer.Rotate(row, row + line, scroll_bottom + 1);
+            term_char blank = Blank();
+            for (int i = scroll_bottom + 1 - line;i <= scroll_bottom;i ++) {
+                buffer.ClearRow(i, blank);
             }
-        } else if (current == 'c' && (escape_buffer == "" || escape_buffer == "0")) {
-            // CSI Ps c, Send Device Attributes, Primary DA
-            // mimic xterm
-            // send CSI ? 1 ; 2 c: I am VT100 with Advance Video Option
-            uint8_t send_buffer[] = {0x1b, '[', '?', '1', ';', '2', 'c'};
-            WriteFull(send_buffer, sizeof(send_buffer));
-        } else if (current == 'c' && (escape_buffer == ">" || escape_buffer == ">0")) {
-            // CSI > Ps c, Send Device Attributes, Secondary DA
-            // mimic xterm
-            // send CSI > 0 ; 2 7 6 ; 0 c: I am VT100
-            uint8_t send_buffer[] = {0x1b, '[', '>', '0', ';', '2', '7', '6', ';', '0', 'c'};
-            WriteFull(send_buffer, sizeof(send_buffer));
-        } else if (current == 'd' && escape_buffer != "") {
-            // CSI Ps d, VPA, move cursor to row #
-            sscanf(escape_buffer.c_str(), "%d", &row);
-            // convert from 1-based to 0-based
-            row--;
-            ClampCursor();
-        } else if (current == 'f') {
-            std::vector<std::string> parts = SplitString(escape_buffer, ";");
-            if (parts.size() == 2) {
-                // CSI Ps ; PS f, CUP, move cursor to x, y
-                sscanf(parts[0].c_str(), "%d", &row);
-                sscanf(parts[1].c_str(), "%d", &col);
-                // convert from 1-based to 0-based
-                row--;
-                col--;
-                ClampCursor();
-            } else {
-                goto unknown;
+            damage.AddRows(row, scroll_bottom + 1, num_cols);
+            // set to first column
+            col = 0;
+        }
+    } else if (current == 'P' && plain) {
+        // CSI Ps P, DCH, delete # characters, move right to left
+        int del = std::min(csi.Get(0, 1), num_cols - col);
+        buffer.Move(row, col + del, num_cols, col);
+        buffer.Fill(row, num_cols - del, num_cols, Blank());
+        damage.Add(row, col, num_cols);
+    } else if (current == 'S' && plain) {
+        // CSI Ps S, SU, Scroll up Ps lines
+        int line = std::min(csi.Get(0, 1), scroll_bottom - scroll_top + 1);
+        buffer.Rotate(scroll_top, scroll_top + line, scroll_bottom + 1);
+        term_char blank = Blank();
+        for (int i = scroll_bottom + 1 - line; i <= scroll_bottom; i++) {
+            buffer.ClearRow(i, blank);
+        }
+        damage.AddRows(scroll_top, scroll_bottom + 1, num_cols);
+    } else if (current == 'X' && plain) {
+        // CSI Ps X, ECH, erase # characters, do not move others
+        int del = std::min(csi.Get(0, 1), num_cols - col);
+        buffer.Fill(row, col, col + del, Blank());
+        damage.Add(row, col, col + del);
+    } else if (current == 'b' && plain) {
+        // CSI Ps b, REP, repeat the preceding graphic character Ps times
+        Repeat(std::max(csi.Get(0, 1), 1));
+    } else if (current == 'x' && rect) {
+        // CSI Pc ; Pt ; Pl ; Pb ; Pr $ x, DECFRA, fill rectangular area with character Pc
+        int top, left, bottom, right;
+        int code = csi.Get(0, 0);
+        if (((code >= 32 && code <= 126) || (code >= 160 && code <= 255)) &&
+            GetRect(csi, 1, top, left, bottom, right)) {
+            term_char c;
+            c.code = code;
+            c.style_id = CurrentStyleId();
+            for (int i = top; i < bottom; i++) {
+                buffer.Fill(i, left, right, c);
+                damage.Add(i, left, right);
             }
-        } else if (current == 'g') {
-            int mode = read_int_or_default(0);
-            if (mode == 0) {
-                // CSI g, CSI 0 g, clear tab stop at the current position
-                tab_stops[col] = false;
-            } else if (mode == 3) {
-                // CSI 3 g, clear all tab stops
-                std::fill(tab_stops.begin(), tab_stops.end(), false);
-            } else {
-                goto unknown;
+        }
+    } else if (current == 'z' && rect) {
+        // CSI Pt ; Pl ; Pb ; Pr $ z, DECERA, erase rectangular area
+        int top, left, bottom, right;
+        if (GetRect(csi, 0, top, left, bottom, right)) {
+            term_char blank = Blank();
+            for (int i = top; i < bottom; i++) {
+                buffer.Fill(i, left, right, blank);
+                damage.Add(i, left, right);
             }
-        } else if (current == 'h' && escape_buffer.size() > 0 && escape_buffer[0] != '?') {
-            // CSI Pm h, Set Mode, SM
-            std::vector<std::string> parts = SplitString(escape_buffer, ";");
-            for (auto part : parts) {
-                if (part == "4") {
-                    // CSI 4 h, Insert Mode (IRM)
-                    insert_mode = true;
-                } else {
-                    LOG_WARN("Unknown CSI Pm h: %s %c",
-                                escape_buffer.c_str(), current);
+        }
+    } else if (current == '{' && rect) {
+        // CSI Pt ; Pl ; Pb ; Pr $ {, DECSERA, selective erase rectangular area
+        // nothing is protected without DECSCA, characters are erased and attributes kept
+        int top, left, bottom, right;
+        if (GetRect(csi, 0, top, left, bottom, right)) {
+            for (int i = top; i < bottom; i++) {
+                term_row line = buffer[i];
+                for (int j = left; j < right; j++) {
+                    line[j].code = ' ';
                 }
+                damage.Add(i, left, right);
             }
-        } else if (current == 'h' && escape_buffer.size() > 0 && escape_buffer[0] == '?') {
-            // CSI ? Pm h, DEC Private Mode Set (DECSET)
-            std::vector<std::string> parts = SplitString(escape_buffer.substr(1), ";");
-            for (auto part : parts) {
-                if (part == "1") {
-                    // CSI ? 1 h, Application Cursor Keys (DECCKM)
-                    // TODO
-                } else if (part == "3") {
-                    // CSI ? 3 h, Enable 132 Column mode, DECCOLM
-                    ResizeTo(num_rows, 132);
-                    ResizeWidth(132 * font_width);
-                } else if (part == "4") {
-                    // CSI ? 4 h, Smooth (Slow) Scroll (DECSCLM)
-                    // TODO
-                } else if (part == "5") {
-                    // CSI ? 5 h, Reverse Video (DECSCNM)
-                    reverse_video = true;
-                } else if (part == "6") {
-                    // CSI ? 6 h, Origin Mode (DECOM)
-                    origin_mode = true;
-                } else if (part == "7") {
-                    // CSI ? 7 h, Set autowrap
-                    enable_wrap = true;
-                } else if (part == "12") {
-                    // CSI ? 12 h, Start blinking cursor
-                    // TODO
-                } else if (part == "25") {
-                    // CSI ? 25 h, DECTCEM, make cursor visible
-                    show_cursor = true;
-                } else if (part == "40") {
-                    // CSI ? 40 h, Allow 80 -> 132 mode, xterm
-                    // TODO
-                } else if (part == "1000") {
-                    // CSI ? 1000 h, Send Mouse X & Y on button press and release
-                    // TODO
-                } else if (part == "1002") {
-                    // CSI ? 1002 h, Use Cell Motion Mouse Tracking
-                    // TODO
-                } else if (part == "1006") {
-                    // CSI ? 1006 h, Enable SGR Mouse Mode
-                    // TODO
-                } else if (part == "2004") {
-                    // CSI ? 2004 h, set bracketed paste mode
-                    // TODO
-                } else {
-                    LOG_WARN("Unknown CSI ? Pm h: %s %c",
-                                escape_buffer.c_str(), current);
-                }
+        }
+    } else if (current == 'v' && rect) {
+        // CSI Pts ; Pls ; Pbs ; Prs ; Pps ; Ptd ; Pld ; Ppd $ v, DECCRA, copy rectangular area
+        // single page, page numbers are ignored
+        int top, left, bottom, right;
+        int base = origin_mode ? scroll_top : 0;
+        int limit = origin_mode ? scroll_bottom + 1 : num_rows;
+        int dest_top = base + std::max(csi.Get(5, 1), 1) - 1;
+        int dest_left = std::max(csi.Get(6, 1), 1) - 1;
+        if (GetRect(csi, 0, top, left, bottom, right) && dest_top < limit && dest_left < num_cols) {
+            // clip the destination to the screen
+            int height = std::min(bottom - top, limit - dest_top);
+            int width = std::min(right - left, num_cols - dest_left);
+            // copy rows in the order that reads each source row before it is overwritten
+            for (int k = 0; k < height; k++) {
+                int i = dest_top > top ? height - 1 - k : k;
+                buffer.Copy(top + i, left, left + width, dest_top + i, dest_left);
+                damage.Add(dest_top + i, dest_left, dest_left + width);
             }
-        } else if (current == 'l' && escape_buffer.size() > 0 && escape_buffer[0] != '?') {
-            // CSI Pm l, Reset Mode, RM
-            std::vector<std::string> parts = SplitString(escape_buffer, ";");
-            for (auto part : parts) {
-                if (part == "4") {
-                    // CSI 4 l, Replace Mode (IRM)
-                    insert_mode = false;
-                } else {
-                    LOG_WARN("Unknown CSI Pm h: %s %c",
-                                escape_buffer.c_str(), current);
-                }
+        }
+    } else if (current == 'c' && plain && csi.Get(0, 0) == 0) {
+        // CSI Ps c, Send Device Attributes, Primary DA
+        // send CSI ? 6 4 ; 1 ; 2 2 ; 2 8 c: I am VT420 with 132 columns, ANSI color and rectangular editing
+        uint8_t send_buffer[] = {0x1b, '[', '?', '6', '4', ';', '1', ';', '2', '2', ';', '2', '8', 'c'};
+        WriteFull(send_buffer, sizeof(send_buffer));
+    } else if (current == 'c' && csi.private_marker == '>' && csi.num_intermediates == 0 && csi.Get(0, 0) == 0) {
+        // CSI > Ps c, Send Device Attributes, Secondary DA
+        // mimic xterm
+        // send CSI > 0 ; 2 7 6 ; 0 c: I am VT100
+        uint8_t send_buffer[] = {0x1b, '[', '>', '0', ';', '2', '7', '6', ';', '0', 'c'};
+        WriteFull(send_buffer, sizeof(send_buffer));
+    } else if (current == 'd' && plain && csi.count > 0) {
+        // CSI Ps d, VPA, move cursor to row #
+        row = csi.Get(0, 1);
+        // convert from 1-based to 0-based
+        row--;
+        ClampCursor();
+    } else if (current == 'f' && plain && csi.count == 2) {
+        // CSI Ps ; PS f, CUP, move cursor to x, y
+        row = csi.Get(0, 1);
+        col = csi.Get(1, 1);
+        // convert from 1-based to 0-based
+        row--;
+        col--;
+        ClampCursor();
+    } else if ((current == 'I' || current == 'Z') && plain) {
+        // CSI Ps I, CHT, move cursor forward Ps tab stops
+        // CSI Ps Z, CBT, move cursor backward Ps tab stops
+        // no more than one move per column
+        int count = std::min(std::max(csi.Get(0, 1), 1), num_cols);
+        for (int i = 0; i < count; i++) {
+            col = current == 'I' ? tab_stops.Next(col) : tab_stops.Prev(col);
+        }
+        ClampCursor();
+    } else if (current == 'g' && plain) {
+        int mode = csi.Get(0, 0);
+        if (mode == 0) {
+            // CSI g, CSI 0 g, clear tab stop at the current position
+            tab_stops.Clear(col);
+        } else if (mode == 3) {
+            // CSI 3 g, clear all tab stops
+            tab_stops.ClearAll();
+        } else {
+            goto unknown;
+        }
+    } else if (current == 'h' && plain && csi.count > 0) {
+        // CSI Pm h, Set Mode, SM
+        for (int i = 0; i < csi.count; i++) {
+            int mode = csi.Get(i, 0);
+            if (mode == 4) {
+                // CSI 4 h, Insert Mode (IRM)
+                insert_mode = true;
+            } else {
+                LOG_WARN("Unknown CSI Pm h: %s %c",
+                            csi.raw, current);
             }
-        } else if (current == 'l' && escape_buffer.size() > 0 && escape_buffer[0] == '?') {
-            // CSI ? Pm l, DEC Private Mode Reset (DECRST)
-            std::vector<std::string> parts = SplitString(escape_buffer.substr(1), ";");
-            for (auto part : parts) {
-                if (part == "1") {
-                    // CSI ? 1 l, Normal Cursor Keys (DECCKM)
-                    // TODO
-                } else if (part == "3") {
-                    // CSI ? 3 l, 80 Column Mode (DECCOLM)
-                    ResizeTo(num_rows, 80);
-                    ResizeWidth(80 * font_width);
-                } else if (part == "4") {
-                    // CSI ? 4 l, Jump (Fast) Scroll (DECSCLM)
-                    // TODO
-                } else if (part == "5") {
-                    // CSI ? 5 l, Normal Video (DECSCNM)
-                    reverse_video = false;
-                } else if (part == "6") {
-                    // CSI ? 6 l, Normal Cursor Mode (DECOM)
-                    origin_mode = false;
-                } else if (part == "7") {
-                    // CSI ? 7 l, Reset autowrap
-                    enable_wrap = false;
-                } else if (part == "8") {
-                    // CSI ? 8 l, No Auto-Repeat Keys (DECARM)
-                    // TODO
-                } else if (part == "12") {
-                    // CSI ? 12 l, Stop blinking cursor
-                    // TODO
-                } else if (part == "25") {
-                    // CSI ? 25 l, Hide cursor (DECTCEM)
-                    show_cursor = true;
-                } else if (part == "45") {
-                    // CSI ? 40 l, Disable Graphic Print Color Syntax (DECGPCS)
-                    // TODO
-                } else if (part == "2004") {
-                    // CSI ? 2004 l, reset bracketed paste mode
-                    // TODO
-                } else {
-                    LOG_WARN("Unknown CSI ? Pm l: %s %c",
-                                escape_buffer.c_str(), current);
+        }
+    } else if (current == 'h' && csi.private_marker == '?' && csi.num_intermediates == 0 && csi.count > 0) {
+        // CSI ? Pm h, DEC Private Mode Set (DECSET)
+        for (int i = 0; i < csi.count; i++) {
+            int mode = csi.Get(i, 0);
+            if (mode == 1) {
+                // CSI ? 1 h, Application Cursor Keys (DECCKM)
+                // TODO
+            } else if (mode == 3) {
+                // CSI ? 3 h, Enable 132 Column mode, DECCOLM
+                ResizeTo(num_rows, 132);
+                ResizeWidth(132 * font_width);
+            } else if (mode == 4) {
+                // CSI ? 4 h, Smooth (Slow) Scroll (DECSCLM)
+                // TODO
+            } else if (mode == 5) {
+                // CSI ? 5 h, Reverse Video (DECSCNM)
+                reverse_video = true;
+                damage.AddAll();
+            } else if (mode == 6) {
+                // CSI ? 6 h, Origin Mode (DECOM)
+                origin_mode = true;
+            } else if (mode == 7) {
+                // CSI ? 7 h, Set autowrap
+                enable_wrap = true;
+            } else if (mode == 12) {
+                // CSI ? 12 h, Start blinking cursor
+                // TODO
+            } else if (mode == 25) {
+                // CSI ? 25 h, DECTCEM, make cursor visible
+                show_cursor = true;
+            } else if (mode == 40) {
+                // CSI ? 40 h, Allow 80 -> 132 mode, xterm
+                // TODO
+            } else if (mode == 47 || mode == 1047) {
+                // CSI ? 47 h, CSI ? 1047 h, Use Alternate Screen Buffer
+                SwitchScreen(true);
+            } else if (mode == 1048) {
+                // CSI ? 1048 h, Save cursor as in DECSC
+                save_row = row;
+                save_col = col;
+                save_style = current_style;
+            } else if (mode == 1049) {
+                // CSI ? 1049 h, Save cursor as in DECSC, switch to and clear Alternate Screen Buffer
+                save_row = row;
+                save_col = col;
+                save_style = current_style;
+                if (!alternate_screen) {
+                    SwitchScreen(true);
+                    term_char blank = Blank();
+                    for (int i = 0; i < num_rows; i++) {
+                        buffer.ClearRow(i, blank);
+                    }
                 }
+            } else if (mode == 1000) {
+                // CSI ? 1000 h, Send Mouse X & Y on button press and release
+                // TODO
+            } else if (mode == 1002) {
+                // CSI ? 1002 h, Use Cell Motion Mouse Tracking
+                // TODO
+            } else if (mode == 1006) {
+                // CSI ? 1006 h, Enable SGR Mouse Mode
+                // TODO
+            } else if (mode == 2004) {
+                // CSI ? 2004 h, set bracketed paste mode
+                // TODO
+            } else {
+                LOG_WARN("Unknown CSI ? Pm h: %s %c",
+                            csi.raw, current);
             }
-        } else if (current == 'm' && (escape_buffer.size() == 0 || escape_buffer[0] != '>')) {
-            // CSI Pm m, Character Attributes (SGR)
-
-            // set color
-            std::vector<std::string> parts = SplitString(escape_buffer, ";");
-            for (size_t i = 0; i < parts.size(); i++) {
-                int param = 0;
-                std::string part = parts[i];
-                sscanf(part.c_str(), "%d", &param);
-                if (param == 0) {
-                    // reset all attributes to their defaults
-                    current_style = term_style();
-                } else if (param == 1) {
-                    // set bold, CSI 1 m
-                    current_style.type = font_class::bold;
-                } else if (param == 2) {
-                    // set faint, CSI 2 m
-                    // TODO
-                } else if (param == 4) {
-                    // set underline, CSI 4 m
-                    // TODO
-                } else if (param == 5 || param == 6) {
-                    // set slowly blink, CSI 5 m
-                    // set rapidly blink, CSI 6 m
-                    current_style.blink = true;
-                } else if (param == 7) {
-                    // inverse, flip foreground and background color, CSI 7 m
-                    std::swap(current_style.fore, current_style.back);
-                } else if (param == 9) {
-                    // set strikethrough, CSI 9 m
-                    // TODO
-                } else if (param == 10) {
-                    // reset to primary font, CSI 10 m
-                    current_style = term_style();
-                } else if (param == 21) {
-                    // set doubly underlined, CSI 21 m
-                    // TODO
-                } else if (param == 22) {
-                    // set not bold faint, CSI 22 m
-                    current_style.type = font_class::regular;
-                } else if (param == 24) {
-                    // set not underlined, CSI 24 m
-                    // TODO
-                } else if (param == 25) {
-                    // set steady (not blinking), CSI 25 m
-                    current_style.blink = false;
-                } else if (param == 27) {
-                    // set positive (not inverse), CSI 27 m
-                    std::swap(current_style.fore, current_style.back);
-                } else if (30 <= param && param <= 37) {
-                    // foreground ansi 0..7
-                    current_style.fore = predefined_colors[param - 30];
-                } else if (param == 38 || param == 48) {
-                    // foreground color: extended color, CSI 38 : ... m
-                    // background color: extended color, CSI 48 : ... m
-                    if (i + 1 < parts.size()) {
-                        int color_type = std::stoi(parts[++i]);
-                        if (color_type == 5 && i + 1 < parts.size()) { // 256-color mode
-                            // specified color index
-                            int color_index = std::stoi(parts[++i]);
-                            uint32_t color = TrueColorFrom(color_index);
-                            if (param == 38) {
-                                current_style.fore = color;
-                            } else {
-                                current_style.back = color;
-                            }
-                        } else if (color_type == 2 && i + 3 < parts.size()) { // RGB mode
-                            // specified rgb
-                            int r = std::stoi(parts[++i]);
-                            int g = std::stoi(parts[++i]);
-                            int b = std::stoi(parts[++i]);
-                            if (param == 38) {
-                                current_style.fore.set_rgb(r,g,b);
-                            } else {
-                                current_style.back.set_rgb(r,g,b);
-                            }
-                        }
+        }
+    } else if (current == 'l' && plain && csi.count > 0) {
+        // CSI Pm l, Reset Mode, RM
+        for (int i = 0; i < csi.count; i++) {
+            int mode = csi.Get(i, 0);
+            if (mode == 4) {
+                // CSI 4 l, Replace Mode (IRM)
+                insert_mode = false;
+            } else {
+                LOG_WARN("Unknown CSI Pm h: %s %c",
+                            csi.raw, current);
+            }
+        }
+    } else if (current == 'l' && csi.private_marker == '?' && csi.num_intermediates == 0 && csi.count > 0) {
+        // CSI ? Pm l, DEC Private Mode Reset (DECRST)
+        for (int i = 0; i < csi.count; i++) {
+            int mode = csi.Get(i, 0);
+            if (mode == 1) {
+                // CSI ? 1 l, Normal Cursor Keys (DECCKM)
+                // TODO
+            } else if (mode == 3) {
+                // CSI ? 3 l, 80 Column Mode (DECCOLM)
+                ResizeTo(num_rows, 80);
+                ResizeWidth(80 * font_width);
+            } else if (mode == 4) {
+                // CSI ? 4 l, Jump (Fast) Scroll (DECSCLM)
+                // TODO
+            } else if (mode == 5) {
+                // CSI ? 5 l, Normal Video (DECSCNM)
+                reverse_video = false;
+                damage.AddAll();
+            } else if (mode == 6) {
+                // CSI ? 6 l, Normal Cursor Mode (DECOM)
+                origin_mode = false;
+            } else if (mode == 7) {
+                // CSI ? 7 l, Reset autowrap
+                enable_wrap = false;
+            } else if (mode == 8) {
+                // CSI ? 8 l, No Auto-Repeat Keys (DECARM)
+                // TODO
+            } else if (mode == 12) {
+                // CSI ? 12 l, Stop blinking cursor
+                // TODO
+            } else if (mode == 25) {
+                // CSI ? 25 l, Hide cursor (DECTCEM)
+                show_cursor = true;
+            } else if (mode == 45) {
+                // CSI ? 40 l, Disable Graphic Print Color Syntax (DECGPCS)
+                // TODO
+            } else if (mode == 47) {
+                // CSI ? 47 l, Use Normal Screen Buffer
+                SwitchScreen(false);
+            } else if (mode == 1047) {
+                // CSI ? 1047 l, Use Normal Screen Buffer, clearing screen first if in the Alternate Screen
+                if (alternate_screen) {
+                    term_char blank = Blank();
+                    for (int i = 0; i < num_rows; i++) {
+                        buffer.ClearRow(i, blank);
                     }
-                } else if (param == 39) {
-                    // default foreground
-                    current_style.fore = predefined_colors[black];
-                } else if (40 <= param && param <= 47) {
-                    // background ansi 0..7
-                    current_style.back = predefined_colors[param - 40];
-                } else if (param == 49) {
-                    // default background
-                    current_style.back = predefined_colors[white];
-                } else if (90 <= param && param <= 97) {
-                    // foreground ansi 8..15
-                    current_style.fore = predefined_colors[8 + param - 90];
-                } else if (100 <= param && param <= 107) {
-                    // background ansi 8..15
-                    current_style.back = predefined_colors[8 + param - 100];
-                } else {
-                    LOG_WARN("Unknown CSI Pm m: %s from %s %c",
-                                part.c_str(), escape_buffer.c_str(), current);
                 }
-            }
-        } else if (current == 'm' && escape_buffer.size() > 0 && escape_buffer[0] == '>') {
-            // CSI > Pp m, XTMODKEYS, set/reset key modifier options
-            // TODO
-        } else if (current == 'n' && escape_buffer == "5") {
-            // CSI 5 n - Device Status Report
-            // send "OK" - ESC [ 0 n
-            uint8_t ok_response[] = {0x1B, '[', '0', 'n'};
-            WriteFull(ok_response, sizeof(ok_response));
-        } else if (current == 'n' && (escape_buffer == "6")) {
-            // CSI Ps n, DSR, Device Status Report
-            // Ps = 6: Report Cursor Position (CPR)
-            // send ESC [ row ; col R
-            char send_buffer[128] = {};
-            snprintf(send_buffer, sizeof(send_buffer), "\x1b[%d;%dR", row + 1, col + 1);
-            int len = strlen(send_buffer);
-            WriteFull((uint8_t *)send_buffer, len);
-        } else if (current == 'r') {
-            // CSI Ps ; Ps r, Set Scrolling Region [top;bottom]
-            std::vector<std::string> parts = SplitString(escape_buffer, ";");
-            int new_top = 1;
-            int new_bottom = num_rows;
-            if (parts.size() == 2) {
-                // CSI Ps ; Ps r
-                sscanf(parts[0].c_str(), "%d", &new_top);
-                sscanf(parts[1].c_str(), "%d", &new_bottom);
-                // convert to 1-based
-                new_top --;
-                new_bottom --;
-            } else if (escape_buffer == "") {
-                // full size of window
-                // CSI r
-                new_top = 0;
-                new_bottom = num_rows - 1;
-            } else if (parts.size() == 1) {
-                // CSI Ps r
-                sscanf(parts[0].c_str(), "%d", &new_top);
-                // convert to 1-based
-                new_top --;
-                new_bottom = num_rows - 1;
+                SwitchScreen(false);
+            } else if (mode == 1048) {
+                // CSI ? 1048 l, Restore cursor as in DECRC
+                row = save_row;
+                col = save_col;
+                ClampCursor();
+                current_style = save_style;
+            } else if (mode == 1049) {
+                // CSI ? 1049 l, Use Normal Screen Buffer and restore cursor as in DECRC
+                SwitchScreen(false);
+                row = save_row;
+                col = save_col;
+                ClampCursor();
+                current_style = save_style;
+            } else if (mode == 2004) {
+                // CSI ? 2004 l, reset bracketed paste mode
+                // TODO
             } else {
-                goto unknown;
+                LOG_WARN("Unknown CSI ? Pm l: %s %c",
+                            csi.raw, current);
             }
+        }
+    } else if (current == 'm' && plain) {
+        // CSI Pm m, Character Attributes (SGR)
+        // full-screen apps repeat a few SGR sequences, serve them from cache
+        bool hit;
+        sgr_cache::entry *entry = sgr.Lookup(csi, hit);
+        if (!entry) {
+            HandleSGR(csi, current_style);
+        } else {
+            if (!hit) {
+                entry->delta = SGRDelta(csi);
+            }
+            entry->delta.Apply(current_style);
+        }
+    } else if (current == 'm' && csi.private_marker == '>') {
+        // CSI > Pp m, XTMODKEYS, set/reset key modifier options
+        // TODO
+    } else if (current == 'n' && plain && csi.Get(0, 0) == 5) {
+        // CSI 5 n - Device Status Report
+        // send "OK" - ESC [ 0 n
+        uint8_t ok_response[] = {0x1B, '[', '0', 'n'};
+        WriteFull(ok_response, sizeof(ok_response));
+    } else if (current == 'n' && plain && csi.Get(0, 0) == 6) {
+        // CSI Ps n, DSR, Device Status Report
+        // Ps = 6: Report Cursor Position (CPR)
+        // send ESC [ row ; col R
+        char send_buffer[128] = {};
+        snprintf(send_buffer, sizeof(send_buffer), "\x1b[%d;%dR", row + 1, col + 1);
+        int len = strlen(send_buffer);
+        WriteFull((uint8_t *)send_buffer, len);
+    } else if (current == 'r' && plain) {
+        // CSI Ps ; Ps r, Set Scrolling Region [top;bottom]
+        // CSI Ps r, bottom defaults to the bottom of window
+        // CSI r, full size of window
+        // zero means default, bottom is limited to the window
+        int new_top = std::max(csi.Get(0, 1), 1);
+        int new_bottom = csi.Get(1, 0) == 0 ? num_rows : std::min(csi.Get(1, 0), num_rows);
+        // convert to 0-based
+        new_top --;
+        new_bottom --;
+
+        if (new_bottom > new_top) {
+            scroll_top = new_top;
+            scroll_bottom = new_bottom;
+
+            // move cursor to new home position
+            row = scroll_top;
+            col = 0;
+        }
+    } else if (current == '@' && plain) {
+        // CSI Ps @, ICH, Insert Ps (Blank) Character(s)
+        int count = std::min(csi.Get(0, 1), num_cols - col);
+        buffer.Move(row, col, num_cols - count, col + count);
+        buffer.Fill(row, col, col + count, Blank());
+        damage.Add(row, col, num_cols);
+    } else {
+unknown:
+        // unknown
+        LOG_WARN("Unknown escape sequence in CSI: %s %c",
+                    csi.raw, current);
+    }
+}
+
+void *terminal_context::TerminalWorker(void * data) {
+    terminal_context *ctx = (terminal_context *)data;
+    ctx->Worker();
+    return NULL;
+}
+
+// actions of the escape sequence parser
+enum vt_actions {
+    action_none,
+    action_print,
+    action_execute,
+    action_collect,
+    action_param,
+    action_esc_dispatch,
+    action_csi_dispatch,
+    action_put,
+    action_osc_put,
+    NUM_VT_ACTIONS,
+};
+
+// DEC compatible state machine, generated at compile time
+// https://vt100.net/emu/dec_ansi_parser
+// each entry packs next state (high nibble) and action (low nibble)
+// bytes >= 0x80 are utf8 and never C1 controls
+struct vt_transition_table {
+    // next state that means no transition, thus no exit/entry actions
+    static constexpr uint8_t STAY = 0xf;
+
+    uint8_t table[NUM_ESCAPE_STATES][256];
+
+    constexpr void Set(int state, int from, int to, vt_actions action, int next = STAY) {
+        for (int i = from; i <= to; i++) {
+            table[state][i] = (uint8_t)(next << 4 | action);
+        }
+    }
+
+    // C0 controls except CAN, SUB and ESC
+    constexpr void SetC0(int state, vt_actions action) {
+        Set(state, 0x00, 0x17, action);
+        Set(state, 0x19, 0x19, action);
+        Set(state, 0x1c, 0x1f, action);
+    }
+
+    constexpr vt_transition_table() : table() {
+        for (int state = 0; state < NUM_ESCAPE_STATES; state++) {
+            Set(state, 0x00, 0xff, action_none);
+        }
+
+        // ground
+        SetC0(state_ground, action_execute);
+        Set(state_ground, 0x20, 0x7e, action_print);
+        Set(state_ground, 0x80, 0xff, action_print);
+
+        // escape
+        SetC0(state_escape, action_execute);
+        Set(state_escape, 0x20, 0x2f, action_collect, state_escape_intermediate);
+        Set(state_escape, 0x30, 0x7e, action_esc_dispatch, state_ground);
+        Set(state_escape, 'P', 'P', action_none, state_dcs_entry);
+        Set(state_escape, 'X', 'X', action_none, state_sos_pm_apc_string);
+        Set(state_escape, '[', '[', action_none, state_csi_entry);
+        Set(state_escape, ']', ']', action_none, state_osc_string);
+        Set(state_escape, '^', '_', action_none, state_sos_pm_apc_string);
+
+        // escape intermediate
+        SetC0(state_escape_intermediate, action_execute);
+        Set(state_escape_intermediate, 0x20, 0x2f, action_collect);
+        Set(state_escape_intermediate, 0x30, 0x7e, action_esc_dispatch, state_ground);
+
+        // csi entry, ':' starts sub-parameters instead of ignoring
+        SetC0(state_csi_entry, action_execute);
+        Set(state_csi_entry, 0x20, 0x2f, action_collect, state_csi_intermediate);
+        Set(state_csi_entry, 0x30, 0x3b, action_param, state_csi_param);
+        Set(state_csi_entry, 0x3c, 0x3f, action_collect, state_csi_param);
+        Set(state_csi_entry, 0x40, 0x7e, action_csi_dispatch, state_ground);
+
+        // csi param
+        SetC0(state_csi_param, action_execute);
+        Set(state_csi_param, 0x20, 0x2f, action_collect, state_csi_intermediate);
+        Set(state_csi_param, 0x30, 0x3b, action_param);
+        Set(state_csi_param, 0x3c, 0x3f, action_none, state_csi_ignore);
+        Set(state_csi_param, 0x40, 0x7e, action_csi_dispatch, state_ground);
+
+        // csi intermediate
+        SetC0(state_csi_intermediate, action_execute);
+        Set(state_csi_intermediate, 0x20, 0x2f, action_collect);
+        Set(state_csi_intermediate, 0x30, 0x3f, action_none, state_csi_ignore);
+        Set(state_csi_intermediate, 0x40, 0x7e, action_csi_dispatch, state_ground);
+
+        // csi ignore
+        SetC0(state_csi_ignore, action_execute);
+        Set(state_csi_ignore, 0x40, 0x7e, action_none, state_ground);
+
+        // dcs entry
+        Set(state_dcs_entry, 0x20, 0x2f, action_collect, state_dcs_intermediate);
+        Set(state_dcs_entry, 0x30, 0x39, action_param, state_dcs_param);
+        Set(state_dcs_entry, 0x3a, 0x3a, action_none, state_dcs_ignore);
+        Set(state_dcs_entry, 0x3b, 0x3b, action_param, state_dcs_param);
+        Set(state_dcs_entry, 0x3c, 0x3f, action_collect, state_dcs_param);
+        Set(state_dcs_entry, 0x40, 0x7e, action_none, state_dcs_passthrough);
+
+        // dcs param
+        Set(state_dcs_param, 0x20, 0x2f, action_collect, state_dcs_intermediate);
+        Set(state_dcs_param, 0x30, 0x39, action_param);
+        Set(state_dcs_param, 0x3a, 0x3a, action_none, state_dcs_ignore);
+        Set(state_dcs_param, 0x3b, 0x3b, action_param);
+        Set(state_dcs_param, 0x3c, 0x3f, action_none, state_dcs_ignore);
+        Set(state_dcs_param, 0x40, 0x7e, action_none, state_dcs_passthrough);
+
+        // dcs intermediate
+        Set(state_dcs_intermediate, 0x20, 0x2f, action_collect);
+        Set(state_dcs_intermediate, 0x30, 0x3f, action_none, state_dcs_ignore);
+        Set(state_dcs_intermediate, 0x40, 0x7e, action_none, state_dcs_passthrough);
+
+        // dcs passthrough
+        SetC0(state_dcs_passthrough, action_put);
+        Set(state_dcs_passthrough, 0x20, 0x7e, action_put);
+        Set(state_dcs_passthrough, 0x80, 0xff, action_put);
+
+        // osc string, terminated by BEL or ST
+        Set(state_osc_string, 0x07, 0x07, action_none, state_ground);
+        Set(state_osc_string, 0x20, 0xff, action_osc_put);
+        Set(state_osc_string, 0x7f, 0x7f, action_none);
+
+        // dcs ignore and sos/pm/apc string ignore everything
+
+        // anywhere: CAN and SUB cancel, ESC restarts
+        for (int state = 0; state < NUM_ESCAPE_STATES; state++) {
+            Set(state, 0x18, 0x18, action_execute, state_ground);
+            Set(state, 0x1a, 0x1a, action_execute, state_ground);
+            Set(state, 0x1b, 0x1b, action_none, state_escape);
+        }
+    }
+};
 
-            if (new_bottom > new_top) {
-                scroll_top = new_top;
-                scroll_bottom = new_bottom;
+static constexpr vt_transition_table vt_transitions;
 
-                // move cursor to new home position
-                row = scroll_top;
-                col = 0;
-            }
-        } else if (current == '@' &&
-                ((escape_buffer.size() > 0 && escape_buffer[escape_buffer.size() - 1] >= '0' &&
-                    escape_buffer[escape_buffer.size() - 1] <= '9') ||
-                    escape_buffer == "")) {
-            // CSI Ps @, ICH, Insert Ps (Blank) Character(s)
-            int count = read_int_or_default(1);
-            for (int i = num_cols - 1; i >= col; i--) {
-                if (i - col < count) {
-                    buffer[row][i].code = ' ';
-                } else {
-                    buffer[row][i] = buffer[row][i - count];
-                }
-            }
-        } else {
-unknown:
-            // unknown
-            LOG_WARN("Unknown escape sequence in CSI: %s %c",
-                        escape_buffer.c_str(), current);
-        }
-        escape_state = state_idle;
-    } else if (current >= 0x20 && current <= 0x3F) {
-        // parameter bytes in [0x30, 0x3F],
-        // or intermediate bytes in [0x20, 0x2F]
-        escape_buffer += current;
-    } else {
-        // invalid byte
-        // unknown
-        LOG_WARN("Unknown escape sequence in CSI: %s %c",
-                    escape_buffer.c_str(), current);
-        escape_state = state_idle;
+// handle C0 control characters
+void terminal_context::HandleControl(uint8_t input) {
+    if (input == '\r') {
+        col = 0;
+    } else if (input == '\n') {
+        // CUD1=\n, cursor down by 1
+        row += 1;
+        DropFirstRowIfOverflow();
+    } else if (input == '\b') {
+        // CUB1=^H, cursor backward by 1
+        if (col > 0) {
+            col -= 1;
+        }
+    } else if (input == '\t') {
+        // goto next tab stop
+        col = tab_stops.Next(col);
+        ClampCursor();
     }
 }
 
-void *terminal_context::TerminalWorker(void * data) {
-    terminal_context *ctx = (terminal_context *)data;
-    ctx->Worker();
-    return NULL;
-}
-
-void terminal_context::Parse(uint8_t input) {
-    if (escape_state == state_esc) {
-        if (input == '[' && escape_buffer == "") {
-            // ESC [ = CSI
-            escape_state = state_csi;
-        } else if (input == ']' && escape_buffer == "") {
-            // ESC ] = OSC
-            escape_state = state_osc;
-        } else if (input == '=' && escape_buffer == "") {
+// handle escape sequences without CSI/OSC/DCS
+void terminal_context::HandleESC(const csi_params &csi, uint8_t current) {
+    if (csi.num_intermediates == 0) {
+        if (current == '=') {
             // ESC =, enter alternate keypad mode
             // TODO
-            escape_state = state_idle;
-        } else if (input == '>' && escape_buffer == "") {
+        } else if (current == '>') {
             // ESC >, exit alternate keypad mode
             // TODO
-            escape_state = state_idle;
-        } else if (input == 'A' && escape_buffer == "") {
+        } else if (current == 'A') {
             // ESC A, cursor up
             row --;
             ClampCursor();
-            escape_state = state_idle;
-        } else if (input == 'B' && escape_buffer == "") {
+        } else if (current == 'B') {
             // ESC B, cursor down
             row ++;
             ClampCursor();
-            escape_state = state_idle;
-        } else if (input == 'C' && escape_buffer == "") {
+        } else if (current == 'C') {
             // ESC C, cursor right
             col ++;
             ClampCursor();
-            escape_state = state_idle;
-        } else if (input == 'D' && escape_buffer == "") {
+        } else if (current == 'D') {
             // ESC D, IND, cursor down and scroll
             row += 1;
             DropFirstRowIfOverflow();
-            escape_state = state_idle;
-        } else if (input == 'E' && escape_buffer == "") {
+        } else if (current == 'E') {
             // ESC E, goto to the beginning of next row
             row ++;
             col = 0;
             ClampCursor();
-            escape_state = state_idle;
-        } else if (input == 'H' && escape_buffer == "") {
+        } else if (current == 'H') {
             // ESC H, place tab stop at the current position
-            tab_stops[col] = true;
-            escape_state = state_idle;
-        } else if (input == 'M' && escape_buffer == "") {
+            tab_stops.Set(col);
+        } else if (current == 'M') {
             // ESC M, move cursor one line up, scrolls down if at the top margin
             if (row == scroll_top) {
-                // shift rows down
-                for (int i = scroll_bottom;i > scroll_top;i--) {
-                    buffer[i] = buffer[i-1];
-                }
-                std::fill(buffer[scroll_top].begin(), buffer[scroll_top].end(), term_char());
+                // shift rows down, reuse the bottom row
+                buffer.Rotate(scroll_top, scroll_bottom, scroll_bottom + 1);
+                buffer.ClearRow(scroll_top, Blank());
+                damage.AddRows(scroll_top, scroll_bottom + 1, num_cols);
             } else {
                 row --;
                 ClampCursor();
             }
-            escape_state = state_idle;
-        } else if (input == 'P' && escape_buffer == "") {
-            // ESC P = DCS
-            escape_state = state_dcs;
-        } else if (input == '8' && escape_buffer == "#") {
-            // ESC # 8, DECALN fill viewport with a test pattern (E)
-            for (int i = 0;i < num_rows;i++) {
-                for (int j = 0;j < num_cols;j++) {
-                    buffer[i][j] = term_char();
-                    buffer[i][j].code = 'E';
-                }
-            }
-            escape_state = state_idle;
-        } else if (input == '7' && escape_buffer == "") {
+        } else if (current == '7') {
             // ESC 7, save cursor
             save_row = row;
             save_col = col;
             save_style = current_style;
-            escape_state = state_idle;
-        } else if (input == '8' && escape_buffer == "") {
+        } else if (current == '8') {
             // ESC 8, restore cursor
             row = save_row;
             col = save_col;
             ClampCursor();
             current_style = save_style;
-            escape_state = state_idle;
-        } else if (input == '#' || input == '(' || input == ')') {
-            // non terminal
-            escape_buffer += input;
+        } else if (current == '\\') {
+            // ESC \, ST, end of OSC/DCS
         } else {
-            // unknown
-            LOG_WARN("Unknown escape sequence after ESC: %s %c",
-                        escape_buffer.c_str(), input);
-            escape_state = state_idle;
-        }
-    } else if (escape_state == state_csi) {
-        HandleCSI(input);
-    } else if (escape_state == state_osc) {
-        if (input == '\x07') {
-            // OSC Ps ; Pt BEL
-            std::vector<std::string> parts = SplitString(escape_buffer, ";");
-            if (parts.size() == 3 && parts[0] == "52" && parts[1] == "c" && parts[2] != "?") {
-                // OSC 52 ; c ; BASE64 BEL
+            goto unknown;
+        }
+    } else if (csi.num_intermediates == 1 && csi.intermediates[0] == '#' && current == '8') {
+        // ESC # 8, DECALN fill viewport with a test pattern (E)
+        for (int i = 0;i < num_rows;i++) {
+            for (int j = 0;j < num_cols;j++) {
+                buffer[i][j] = term_char();
+                buffer[i][j].code = 'E';
+            }
+        }
+        damage.AddRows(0, num_rows, num_cols);
+    } else if (csi.num_intermediates == 1 && csi.intermediates[0] >= '(' && csi.intermediates[0] <= '+') {
+        // ESC ( C, designate G0-G3 character set
+        // TODO
+    } else {
+unknown:
+        // unknown
+        LOG_WARN("Unknown escape sequence after ESC: %s %c",
+                    csi.raw, current);
+    }
+}
+
+// handle OSC escape sequences
+void terminal_context::HandleOSC(int command, const std::string &data) {
+    if (command == 52) {
+        size_t semicolon = data.find(';');
+        if (semicolon != std::string::npos && data.compare(0, semicolon, "c") == 0) {
+            if (data.compare(semicolon + 1, std::string::npos, "?") == 0) {
+                // OSC 52 ; c ; ? ST
+                // paste from clipboard
+                RequestPaste();
+                LOG_INFO("Request Paste from pasteboard: %s", data.c_str());
+            } else {
+                // OSC 52 ; c ; BASE64 ST
                 // copy to clipboard
-                std::string base64 = parts[2];
+                std::string base64 = data.substr(semicolon + 1);
                 LOG_INFO("Copy to pasteboard in native: %s",
                             base64.c_str());
                 Copy(base64);
-            } else if (parts.size() == 3 && parts[0] == "52" && parts[1] == "c" && parts[2] == "?") {
-                // OSC 52 ; c ; ? BEL
-                // paste from clipboard
-                RequestPaste();
-                LOG_INFO("Request Paste from pasteboard: %s", escape_buffer.c_str());
-            }
-            escape_state = state_idle;
-        } else if (input == '\\' && escape_buffer.size() > 0 && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
-            // ST is ESC \
-            // OSC Ps ; Pt ST
-            std::vector<std::string> parts = SplitString(escape_buffer.substr(0, escape_buffer.size() - 1), ";");
-            if (parts.size() == 2 && parts[0] == "10" && parts[1] == "?") {
-                // OSC 10 ; ? ST
-                // report foreground color: black
-                // send OSI 10 ; r g b : 0 / 0 / 0 ST
-                uint8_t send_buffer[] = {0x1b, ']', '1', '0', ';', 'r', 'g', 'b', ':', '0', '/', '0', '/', '0', '\x1b', '\\'};
-                WriteFull(send_buffer, sizeof(send_buffer));
-            } else if (parts.size() == 2 && parts[0] == "11" && parts[1] == "?") {
-                // OSC 11 ; ? ST
-                // report background color: white
-                // send OSI 11 ; r g b : f / f / f ST
-                uint8_t send_buffer[] = {0x1b, ']', '1', '0', ';', 'r', 'g', 'b', ':', 'f', '/', 'f', '/', 'f', '\x1b', '\\'};
-                WriteFull(send_buffer, sizeof(send_buffer));
-            }
-            escape_state = state_idle;
-        } else if ((input >= ' ' && input < 127) || input == '\x1b') {
-            // printable character
-            escape_buffer += input;
-        } else {
-            // unknown
-            LOG_WARN("Unknown escape sequence in OSC: %s %c",
-                        escape_buffer.c_str(), input);
-            escape_state = state_idle;
-        }
-    } else if (escape_state == state_dcs) {
-        if (input == '\\' && escape_buffer.size() > 0 && escape_buffer[escape_buffer.size() - 1] == '\x1b') {
-            // ST
-            escape_state = state_idle;
-        } else if (input == '\x1b' || input >= ' ' && input < 127) {
-            // printable character
-            escape_buffer += input;
-        } else {
-            // unknown
-            LOG_WARN("Unknown escape sequence in DCS: %s %c",
-                        escape_buffer.c_str(), input);
-            escape_state = state_idle;
-        }
-    } else if (escape_state == state_idle) {
-        // escape state is idle
-        if (utf8_state == state_initial) {
-            if (input >= ' ' && input <= 0x7f) {
-                // printable
-                if (insert_mode) {
-                    // move characters rightward
-                    for (int i = num_cols - 1;i > col;i--) {
-                        buffer[row][i] = buffer[row][i - 1];
-                    }
-                }
-                InsertUtf8(input);
-            } else if (input >= 0xc2 && input <= 0xdf) {
-                // 2-byte utf8
-                utf8_state = state_2byte_2;
-                current_utf8 = (uint32_t)(input & 0x1f) << 6;
-            } else if (input == 0xe0) {
-                // 3-byte utf8 starting with e0
-                utf8_state = state_3byte_2_e0;
-                current_utf8 = (uint32_t)(input & 0x0f) << 12;
-            } else if (input >= 0xe1 && input <= 0xef) {
-                // 3-byte utf8 starting with non-e0
-                utf8_state = state_3byte_2_non_e0;
-                current_utf8 = (uint32_t)(input & 0x0f) << 12;
-            } else if (input == 0xf0) {
-                // 4-byte utf8 starting with f0
-                utf8_state = state_4byte_2_f0;
-                current_utf8 = (uint32_t)(input & 0x07) << 18;
-            } else if (input >= 0xf1 && input <= 0xf3) {
-                // 4-byte utf8 starting with f1 to f3
-                utf8_state = state_4byte_2_f1_f3;
-                current_utf8 = (uint32_t)(input & 0x07) << 18;
-            } else if (input == 0xf4) {
-                // 4-byte utf8 starting with f4
-                utf8_state = state_4byte_2_f4;
-                current_utf8 = (uint32_t)(input & 0x07) << 18;
-            } else if (input == '\r') {
-                col = 0;
-            } else if (input == '\n') {
-                // CUD1=\n, cursor down by 1
-                row += 1;
-                DropFirstRowIfOverflow();
-            } else if (input == '\b') {
-                // CUB1=^H, cursor backward by 1
-                if (col > 0) {
-                    col -= 1;
-                }
-            } else if (input == '\t') {
-                // goto next tab stop
-                col ++;
-                while (col < num_cols && !tab_stops[col]) {
-                    col ++;
-                }
-                ClampCursor();
-            } else if (input == 0x1b) {
-                escape_buffer = "";
-                escape_state = state_esc;
-            }
-        } else if (utf8_state == state_2byte_2) {
-            // expecting the second byte of 2-byte utf-8
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (input & 0x3f);
-                InsertUtf8(current_utf8);
             }
-            utf8_state = state_initial;
-        } else if (utf8_state == state_3byte_2_e0) {
-            // expecting the second byte of 3-byte utf-8 starting with 0xe0
-            if (input >= 0xa0 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 6;
-                utf8_state = state_3byte_3;
-            } else {
-                utf8_state = state_initial;
+        }
+    } else if (command == 4) {
+        // OSC 4 ; c ; spec ST, set or query (spec = ?) palette color c
+        // multiple pairs allowed: OSC 4 ; c1 ; spec1 ; c2 ; spec2 ST
+        size_t begin = 0;
+        while (begin < data.size()) {
+            size_t semicolon = data.find(';', begin);
+            if (semicolon == std::string::npos) {
+                break;
             }
-        } else if (utf8_state == state_3byte_2_non_e0) {
-            // expecting the second byte of 3-byte utf-8 starting with non-0xe0
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 6;
-                utf8_state = state_3byte_3;
+            size_t end = std::min(data.find(';', semicolon + 1), data.size());
+            int index = atoi(data.c_str() + begin);
+            std::string spec = data.substr(semicolon + 1, end - semicolon - 1);
+            if (index < 0 || index > 255) {
+                LOG_WARN("Invalid palette index in OSC 4: %d", index);
+            } else if (spec == "?") {
+                ReportColor(4, index, palette.colors[index]);
+            } else if (ParseColorSpec(spec, palette.colors[index])) {
+                damage.AddAll();
             } else {
-                utf8_state = state_initial;
+                LOG_WARN("Unknown color spec in OSC 4: %s", spec.c_str());
             }
-        } else if (utf8_state == state_3byte_3) {
-            // expecting the third byte of 3-byte utf-8 starting with 0xe0
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (input & 0x3f);
-                InsertUtf8(current_utf8);
+            begin = end + 1;
+        }
+    } else if (command == 10 || command == 11) {
+        // OSC 10 ; spec ST, set or query (spec = ?) default foreground color
+        // OSC 11 ; spec ST, set or query (spec = ?) default background color
+        uint32_t &target = command == 10 ? palette.fore : palette.back;
+        if (data == "?") {
+            ReportColor(command, -1, target);
+        } else if (ParseColorSpec(data, target)) {
+            damage.AddAll();
+        } else {
+            LOG_WARN("Unknown color spec in OSC %d: %s", command, data.c_str());
+        }
+    } else if (command == 104) {
+        // OSC 104 ; c ST, reset palette color c, or all colors without c
+        term_palette initial;
+        if (data.empty()) {
+            std::copy(std::begin(initial.colors), std::end(initial.colors), palette.colors);
+        }
+        for (size_t begin = 0; begin < data.size();) {
+            size_t end = std::min(data.find(';', begin), data.size());
+            int index = atoi(data.c_str() + begin);
+            if (index >= 0 && index <= 255) {
+                palette.colors[index] = initial.colors[index];
             }
+            begin = end + 1;
+        }
+        damage.AddAll();
+    } else if (command == 110) {
+        // OSC 110 ST, reset default foreground color
+        palette.fore = term_palette().fore;
+        damage.AddAll();
+    } else if (command == 111) {
+        // OSC 111 ST, reset default background color
+        palette.back = term_palette().back;
+        damage.AddAll();
+    }
+}
+
+// parse color spec of OSC 4/10/11: rgb:r/g/b with 1 to 4 hex digits per component, or #rgb/#rrggbb
+bool terminal_context::ParseColorSpec(const std::string &spec, uint32_t &rgb) {
+    // parse hex digits, scale to 8 bits
+    auto component = [](const std::string &hex, int &value) {
+        if (hex.empty() || hex.size() > 4 || hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+            return false;
+        }
+        int max = (1 << (4 * hex.size())) - 1;
+        value = (strtol(hex.c_str(), nullptr, 16) * 255 + max / 2) / max;
+        return true;
+    };
+
+    int r, g, b;
+    if (spec.compare(0, 4, "rgb:") == 0) {
+        size_t slash1 = spec.find('/', 4);
+        size_t slash2 = slash1 == std::string::npos ? slash1 : spec.find('/', slash1 + 1);
+        if (slash2 == std::string::npos || !component(spec.substr(4, slash1 - 4), r) ||
+            !component(spec.substr(slash1 + 1, slash2 - slash1 - 1), g) || !component(spec.substr(slash2 + 1), b)) {
+            return false;
+        }
+    } else if (spec.size() == 4 || spec.size() == 7) {
+        if (spec[0] != '#') {
+            return false;
+        }
+        size_t digits = (spec.size() - 1) / 3;
+        if (!component(spec.substr(1, digits), r) || !component(spec.substr(1 + digits, digits), g) ||
+            !component(spec.substr(1 + 2 * digits, digits), b)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    rgb = PACK_RGB(r, g, b);
+    return true;
+}
+
+// reply to color query of OSC 4/10/11 in xterm format: OSC Ps ; [c ;] rgb:rrrr/gggg/bbbb ST
+void terminal_context::ReportColor(int command, int index, uint32_t rgb) {
+    term_style::color color(rgb);
+    char send_buffer[64];
+    int length;
+    if (index >= 0) {
+        length = snprintf(send_buffer, sizeof(send_buffer), "\x1b]%d;%d;rgb:%02x%02x/%02x%02x/%02x%02x\x1b\\", command,
+                          index, color.u.red, color.u.red, color.u.green, color.u.green, color.u.blue, color.u.blue);
+    } else {
+        length = snprintf(send_buffer, sizeof(send_buffer), "\x1b]%d;rgb:%02x%02x/%02x%02x/%02x%02x\x1b\\", command,
+                          color.u.red, color.u.red, color.u.green, color.u.green, color.u.blue, color.u.blue);
+    }
+    WriteFull((uint8_t *)send_buffer, length);
+}
+
+// feed a byte of OSC/DCS payload
+void vt_tokenizer::PutPayload(uint8_t input) {
+    if (payload.length >= payload.limit.max_length) {
+        // keep consuming until the terminator, but never store it
+        if (!payload.overflow) {
+            LOG_WARN("OSC/DCS payload exceeds %zu bytes, %s", payload.limit.max_length,
+                     payload.limit.policy == policy_drop ? "dropped" : "truncated");
+            payload.overflow = true;
+        }
+        return;
+    }
+    payload.chunk[payload.chunk_length++] = input;
+    payload.length++;
+    if (payload.chunk_length == string_payload::CHUNK_SIZE) {
+        FlushPayload();
+    }
+}
+
+// pass buffered payload to the OSC/DCS handler
+void vt_tokenizer::FlushPayload() {
+    if (payload.chunk_length == 0) {
+        return;
+    }
+    if (escape_state == state_osc_string) {
+        HandleOSCChunk(payload.chunk, payload.chunk_length);
+    } else {
+        HandleDCSChunk(payload.chunk, payload.chunk_length);
+    }
+    payload.chunk_length = 0;
+}
+
+// OSC commands handled by terminal_context::HandleOSC
+static bool IsSupportedOSC(int command) {
+    return command == 4 || command == 10 || command == 11 || command == 52 || command == 104 || command == 110 ||
+           command == 111;
+}
+
+// handle a chunk of OSC payload
+void vt_tokenizer::HandleOSCChunk(const uint8_t *data, size_t length) {
+    if (IsSupportedOSC(osc_command)) {
+        // bounded by the payload limit
+        osc_data.append((const char *)data, length);
+    }
+}
+
+// OSC terminated, emit token if supported
+void vt_tokenizer::EndOSC(token_batch &batch) {
+    FlushPayload();
+    if (osc_command == -1) {
+        // OSC Ps ST without Pt
+        osc_command = osc_number;
+    }
+
+    if (!payload.Accepted()) {
+        // drop the whole sequence
+    } else if (IsSupportedOSC(osc_command)) {
+        batch.PushOSC(osc_command, std::move(osc_data));
+    }
+
+    // release clipboard sized buffers
+    if (osc_data.capacity() > osc_limit.max_length) {
+        std::string().swap(osc_data);
+    } else {
+        osc_data.clear();
+    }
+}
+
+// handle a chunk of DCS payload
+void vt_tokenizer::HandleDCSChunk(const uint8_t *data, size_t length) {
+    // no DCS sequence is supported, payload is discarded
+}
+
+// DCS terminated
+void vt_tokenizer::EndDCS() {
+    FlushPayload();
+    LOG_WARN("Unknown escape sequence in DCS: %s %c, %zu bytes of payload",
+                csi.raw, dcs_final, payload.length);
+}
+
+// decode utf8 byte by byte
+void vt_tokenizer::DecodeUtf8(uint8_t input, token_batch &batch) {
+    if (utf8_state == state_initial) {
+        if (input >= 0xc2 && input <= 0xdf) {
+            // 2-byte utf8
+            utf8_state = state_2byte_2;
+            current_utf8 = (uint32_t)(input & 0x1f) << 6;
+        } else if (input == 0xe0) {
+            // 3-byte utf8 starting with e0
+            utf8_state = state_3byte_2_e0;
+            current_utf8 = (uint32_t)(input & 0x0f) << 12;
+        } else if (input >= 0xe1 && input <= 0xef) {
+            // 3-byte utf8 starting with non-e0
+            utf8_state = state_3byte_2_non_e0;
+            current_utf8 = (uint32_t)(input & 0x0f) << 12;
+        } else if (input == 0xf0) {
+            // 4-byte utf8 starting with f0
+            utf8_state = state_4byte_2_f0;
+            current_utf8 = (uint32_t)(input & 0x07) << 18;
+        } else if (input >= 0xf1 && input <= 0xf3) {
+            // 4-byte utf8 starting with f1 to f3
+            utf8_state = state_4byte_2_f1_f3;
+            current_utf8 = (uint32_t)(input & 0x07) << 18;
+        } else if (input == 0xf4) {
+            // 4-byte utf8 starting with f4
+            utf8_state = state_4byte_2_f4;
+            current_utf8 = (uint32_t)(input & 0x07) << 18;
+        }
+    } else if (utf8_state == state_2byte_2) {
+        // expecting the second byte of 2-byte utf-8
+        if (input >= 0x80 && input <= 0xbf) {
+            current_utf8 |= (input & 0x3f);
+            batch.PushCodepoints(&current_utf8, 1);
+        }
+        utf8_state = state_initial;
+    } else if (utf8_state == state_3byte_2_e0) {
+        // expecting the second byte of 3-byte utf-8 starting with 0xe0
+        if (input >= 0xa0 && input <= 0xbf) {
+            current_utf8 |= (uint32_t)(input & 0x3f) << 6;
+            utf8_state = state_3byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_3byte_2_non_e0) {
+        // expecting the second byte of 3-byte utf-8 starting with non-0xe0
+        if (input >= 0x80 && input <= 0xbf) {
+            current_utf8 |= (uint32_t)(input & 0x3f) << 6;
+            utf8_state = state_3byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_3byte_3) {
+        // expecting the third byte of 3-byte utf-8 starting with 0xe0
+        if (input >= 0x80 && input <= 0xbf) {
+            current_utf8 |= (input & 0x3f);
+            batch.PushCodepoints(&current_utf8, 1);
+        }
+        utf8_state = state_initial;
+    } else if (utf8_state == state_4byte_2_f0) {
+        // expecting the second byte of 4-byte utf-8 starting with 0xf0
+        if (input >= 0x90 && input <= 0xbf) {
+            current_utf8 |= (uint32_t)(input & 0x3f) << 12;
+            utf8_state = state_4byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_4byte_2_f1_f3) {
+        // expecting the second byte of 4-byte utf-8 starting with 0xf0 to 0xf3
+        if (input >= 0x80 && input <= 0xbf) {
+            current_utf8 |= (uint32_t)(input & 0x3f) << 12;
+            utf8_state = state_4byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_4byte_2_f4) {
+        // expecting the second byte of 4-byte utf-8 starting with 0xf4
+        if (input >= 0x80 && input <= 0x8f) {
+            current_utf8 |= (uint32_t)(input & 0x3f) << 12;
+            utf8_state = state_4byte_3;
+        } else {
+            utf8_state = state_initial;
+        }
+    } else if (utf8_state == state_4byte_3) {
+        // expecting the third byte of 4-byte utf-8
+        if (input >= 0x80 && input <= 0xbf) {
+            current_utf8 |= (uint32_t)(input & 0x3f) << 6;
+            utf8_state = state_4byte_4;
+        } else {
             utf8_state = state_initial;
-        } else if (utf8_state == state_4byte_2_f0) {
-            // expecting the second byte of 4-byte utf-8 starting with 0xf0
-            if (input >= 0x90 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 12;
-                utf8_state = state_4byte_3;
+        }
+    } else if (utf8_state == state_4byte_4) {
+        // expecting the third byte of 4-byte utf-8
+        if (input >= 0x80 && input <= 0xbf) {
+            current_utf8 |= (input & 0x3f);
+            batch.PushCodepoints(&current_utf8, 1);
+        }
+        utf8_state = state_initial;
+    } else {
+        assert(false && "unreachable utf8 state");
+    }
+}
+
+void vt_tokenizer::Put(uint8_t input, token_batch &batch) {
+    // bytes within an utf8 sequence go to the decoder first
+    if (utf8_state != state_initial) {
+        DecodeUtf8(input, batch);
+        return;
+    }
+
+    uint8_t transition = vt_transitions.table[escape_state][input];
+    uint8_t next_state = transition >> 4;
+    if (next_state != vt_transition_table::STAY) {
+        // exit action
+        if (escape_state == state_osc_string) {
+            EndOSC(batch);
+        } else if (escape_state == state_dcs_passthrough) {
+            // unhook
+            EndDCS();
+        }
+    }
+
+    // transition action, compiles to a jump table
+    switch ((vt_actions)(transition & 0xf)) {
+    case action_none:
+        break;
+    case action_print:
+        if (input >= 0x80) {
+            DecodeUtf8(input, batch);
+        } else {
+            batch.PushText(&input, 1);
+        }
+        break;
+    case action_execute:
+        batch.PushControl(input);
+        break;
+    case action_collect:
+    case action_param:
+        csi.Put(input);
+        break;
+    case action_esc_dispatch:
+        batch.PushSequence(token_esc, csi, input);
+        break;
+    case action_csi_dispatch:
+        csi.Finish();
+        batch.PushSequence(token_csi, csi, input);
+        break;
+    case action_put:
+        PutPayload(input);
+        break;
+    case action_osc_put:
+        if (osc_command >= 0) {
+            PutPayload(input);
+        } else if (osc_command == -1) {
+            // parse OSC Ps
+            if (input >= '0' && input <= '9') {
+                osc_number = std::min(osc_number * 10 + (input - '0'), csi_params::MAX_VALUE);
+            } else if (input == ';') {
+                osc_command = osc_number;
+                payload.Clear(osc_command == 52 ? clipboard_limit : osc_limit);
             } else {
-                utf8_state = state_initial;
+                osc_command = -2;
             }
-        } else if (utf8_state == state_4byte_2_f1_f3) {
-            // expecting the second byte of 4-byte utf-8 starting with 0xf0 to 0xf3
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 12;
-                utf8_state = state_4byte_3;
+        }
+        break;
+    default:
+        assert(false && "unreachable escape action");
+    }
+
+    if (next_state != vt_transition_table::STAY) {
+        escape_state = (escape_states)next_state;
+        // entry action
+        if (escape_state == state_escape || escape_state == state_csi_entry || escape_state == state_dcs_entry) {
+            csi.Clear();
+        } else if (escape_state == state_osc_string) {
+            osc_command = -1;
+            osc_number = 0;
+            payload.Clear(osc_limit);
+        } else if (escape_state == state_dcs_passthrough) {
+            // hook
+            csi.Finish();
+            dcs_final = input;
+            payload.Clear(dcs_limit);
+        }
+    }
+}
+
+// length of the leading run of printable ascii in [0x20, 0x7e]
+static size_t PrintableAsciiRun(const uint8_t *data, size_t length) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i upper = _mm_set1_epi8(0x7e);
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        // signed comparison: bytes >= 0x80 are negative, thus less than 0x20
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, lower), _mm_cmpgt_epi8(v, upper));
+        int mask = _mm_movemask_epi8(bad);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t lower = vdupq_n_u8(0x20);
+    const uint8x16_t upper = vdupq_n_u8(0x7e);
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t v = vld1q_u8(data + i);
+        uint8x16_t bad = vorrq_u8(vcltq_u8(v, lower), vcgtq_u8(v, upper));
+        // narrow each byte to 4 bits of a 64-bit mask
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(bad), 4)), 0);
+        if (mask) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        if (data[i] < 0x20 || data[i] > 0x7e) {
+            break;
+        }
+    }
+    return i;
+}
+
+// utf8 lead byte: length of the sequence and valid range of the second byte,
+// mirrors the utf8_states transitions in DecodeUtf8
+struct utf8_lead {
+    uint8_t length;
+    uint8_t min;
+    uint8_t max;
+};
+
+struct utf8_lead_table {
+    utf8_lead entries[256];
+
+    constexpr utf8_lead_table() : entries() {
+        for (int i = 0; i < 256; i++) {
+            if (i >= 0xc2 && i <= 0xdf) {
+                entries[i] = {2, 0x80, 0xbf};
+            } else if (i == 0xe0) {
+                entries[i] = {3, 0xa0, 0xbf};
+            } else if (i >= 0xe1 && i <= 0xef) {
+                entries[i] = {3, 0x80, 0xbf};
+            } else if (i == 0xf0) {
+                entries[i] = {4, 0x90, 0xbf};
+            } else if (i >= 0xf1 && i <= 0xf3) {
+                entries[i] = {4, 0x80, 0xbf};
+            } else if (i == 0xf4) {
+                entries[i] = {4, 0x80, 0x8f};
             } else {
-                utf8_state = state_initial;
+                entries[i] = {0, 0, 0};
             }
-        } else if (utf8_state == state_4byte_2_f4) {
-            // expecting the second byte of 4-byte utf-8 starting with 0xf4
-            if (input >= 0x80 && input <= 0x8f) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 12;
-                utf8_state = state_4byte_3;
-            } else {
-                utf8_state = state_initial;
+        }
+    }
+};
+
+static constexpr utf8_lead_table utf8_leads;
+
+static inline bool IsUtf8Continuation(uint8_t byte) {
+    return (byte & 0xc0) == 0x80;
+}
+
+// decode a run of complete and valid utf8 sequences into codepoints
+// stops at ascii, invalid or truncated input, which is left to the state machine
+// returns the number of bytes consumed
+static size_t DecodeUtf8Run(const uint8_t *data, size_t length, uint32_t *codepoints, size_t max_codepoints,
+                            size_t *num_codepoints) {
+    size_t i = 0;
+    size_t n = 0;
+    while (n < max_codepoints && i < length) {
+        const utf8_lead &lead = utf8_leads.entries[data[i]];
+        if (lead.length == 0 || lead.length > length - i) {
+            break;
+        }
+        uint8_t second = data[i + 1];
+        if (second < lead.min || second > lead.max) {
+            break;
+        }
+
+        uint32_t codepoint;
+        if (lead.length == 2) {
+            codepoint = (uint32_t)(data[i] & 0x1f) << 6 | (second & 0x3f);
+        } else if (lead.length == 3) {
+            if (!IsUtf8Continuation(data[i + 2])) {
+                break;
             }
-        } else if (utf8_state == state_4byte_3) {
-            // expecting the third byte of 4-byte utf-8
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (uint32_t)(input & 0x3f) << 6;
-                utf8_state = state_4byte_4;
-            } else {
-                utf8_state = state_initial;
+            codepoint = (uint32_t)(data[i] & 0x0f) << 12 | (uint32_t)(second & 0x3f) << 6 | (data[i + 2] & 0x3f);
+        } else {
+            if (!IsUtf8Continuation(data[i + 2]) || !IsUtf8Continuation(data[i + 3])) {
+                break;
+            }
+            codepoint = (uint32_t)(data[i] & 0x07) << 18 | (uint32_t)(second & 0x3f) << 12 |
+                        (uint32_t)(data[i + 2] & 0x3f) << 6 | (data[i + 3] & 0x3f);
+        }
+        codepoints[n++] = codepoint;
+        i += lead.length;
+    }
+    *num_codepoints = n;
+    return i;
+}
+
+void vt_tokenizer::Tokenize(const uint8_t *data, size_t length, token_batch &batch) {
+    size_t i = 0;
+    while (i < length) {
+        if (escape_state == state_ground && utf8_state == state_initial) {
+            // fast path: printable ascii runs in bulk
+            size_t run = PrintableAsciiRun(data + i, length - i);
+            if (run > 0) {
+                batch.PushText(data + i, run);
+                i += run;
+                continue;
             }
-        } else if (utf8_state == state_4byte_4) {
-            // expecting the third byte of 4-byte utf-8
-            if (input >= 0x80 && input <= 0xbf) {
-                current_utf8 |= (input & 0x3f);
-                InsertUtf8(current_utf8);
+
+            // fast path: decode multi-byte utf8 runs in blocks
+            if (data[i] >= 0xc2) {
+                uint32_t codepoints[256];
+                size_t num_codepoints = 0;
+                size_t consumed = DecodeUtf8Run(data + i, length - i, codepoints, 256, &num_codepoints);
+                if (consumed > 0) {
+                    batch.PushCodepoints(codepoints, num_codepoints);
+                    i += consumed;
+                    continue;
+                }
             }
-            utf8_state = state_initial;
-        } else {
-            assert(false && "unreachable utf8 state");
         }
-    } else {
-        assert(false && "unreachable escape state");
+        Put(data[i++], batch);
+    }
+}
+
+void token_batch::Clear() {
+    tokens.clear();
+    text.clear();
+    codepoints.clear();
+    params.clear();
+    osc.clear();
+}
+
+void token_batch::PushText(const uint8_t *data, size_t length) {
+    if (tokens.empty() || tokens.back().type != token_print_ascii) {
+        tokens.push_back({token_print_ascii, 0, (uint32_t)text.size(), 0});
+    }
+    text.insert(text.end(), data, data + length);
+    tokens.back().length += length;
+}
+
+void token_batch::PushCodepoints(const uint32_t *data, size_t length) {
+    if (tokens.empty() || tokens.back().type != token_print_codepoints) {
+        tokens.push_back({token_print_codepoints, 0, (uint32_t)codepoints.size(), 0});
+    }
+    codepoints.insert(codepoints.end(), data, data + length);
+    tokens.back().length += length;
+}
+
+void token_batch::PushControl(uint8_t input) {
+    tokens.push_back({token_control, input, 0, 0});
+}
+
+void token_batch::PushSequence(vt_token_type type, const csi_params &csi, uint8_t current) {
+    tokens.push_back({type, current, (uint32_t)params.size(), 1});
+    params.push_back(csi);
+}
+
+void token_batch::PushOSC(int command, std::string data) {
+    tokens.push_back({token_osc, 0, (uint32_t)osc.size(), 1});
+    osc.emplace_back(command, std::move(data));
+}
+
+// second stage of parsing: apply tokens to the terminal
+void terminal_context::Apply(const token_batch &batch) {
+    for (const vt_token &token : batch.tokens) {
+        switch (token.type) {
+        case token_print_ascii:
+            InsertPrintable(&batch.text[token.offset], token.length);
+            break;
+        case token_print_codepoints:
+            InsertCodepoints(&batch.codepoints[token.offset], token.length);
+            break;
+        case token_control:
+            HandleControl(token.byte);
+            break;
+        case token_esc:
+            HandleESC(batch.params[token.offset], token.byte);
+            break;
+        case token_csi:
+            HandleCSI(batch.params[token.offset], token.byte);
+            break;
+        case token_osc:
+            HandleOSC(batch.osc[token.offset].first, batch.osc[token.offset].second);
+            break;
+        default:
+            assert(false && "unreachable token type");
+        }
     }
+    snapshot_pending = true;
+}
+
+void terminal_context::Parse(uint8_t input) {
+    ParseBuffer(&input, 1);
+}
+
+void terminal_context::ParseBuffer(const uint8_t *data, size_t length) {
+    tokenizer.Tokenize(data, length, batch);
+    Apply(batch);
+    batch.Clear();
 }
 
 void terminal_context::Worker() {
@@ -1187,12 +2971,16 @@ void terminal_context::Worker() {
                 }
                 LOG_INFO("Got: %s", hex.c_str());
 
-                // parse output
+                // tokenize without lock, then apply under lock
+                tokenizer.Tokenize(buffer, r, batch);
                 pthread_mutex_lock(&lock);
-                for (int i = 0; i < r; i++) {
-                    Parse(buffer[i]);
+                Apply(batch);
+                // at most one snapshot per frame, the renderer publishes the rest when output stops
+                if (snapshot_wanted) {
+                    Publish();
                 }
                 pthread_mutex_unlock(&lock);
+                batch.Clear();
             } else if (r < 0 && errno == EIO) {
                 // handle child exit
                 LOG_INFO("Program exited: %ld %d", r, errno);
@@ -1216,6 +3004,7 @@ void terminal_context::Worker() {
                 row += 1;
                 DropFirstRowIfOverflow();
                 col = 0;
+                snapshot_pending = true;
 
                 Fork();
                 pthread_mutex_unlock(&lock);
@@ -1244,6 +3033,8 @@ void terminal_context::Fork() {
     ws.ws_row = num_rows;
 
     int pid = forkpty(&fd, nullptr, nullptr, &ws);
+    winsize_rows = num_rows;
+    winsize_cols = num_cols;
     if (!pid) {
 #ifdef STANDALONE
         execl("/bin/bash", "/bin/bash", nullptr);
@@ -1519,19 +3310,60 @@ static void Draw() {
     gettimeofday(&tv, nullptr);
     uint64_t current_msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
 
+    // viewport and scroll offset are changed by the UI thread under lock
+    pthread_mutex_lock(&term.lock);
+    int width = buffer_width;
+    int height = buffer_height;
+    int max_lines = height / font_height;
+    // resizes since the last frame are applied once, with the latest size
+    if (resize_pending) {
+        resize_pending = false;
+        int new_rows = std::max(height / font_height, 1);
+        int new_cols = std::max(width / font_width, 1);
+        if (new_rows != term.num_rows || new_cols != term.num_cols) {
+            ResizeTo(new_rows, new_cols, false);
+        }
+    }
+    term.ReportSize(MonotonicMsec());
+    // ensure at least one line shown, for very large scroll_offset
+    if ((int)term.history.size() + max_lines - 1 - scroll_offset / font_height < 0) {
+        scroll_offset = ((int)term.history.size() + max_lines - 1) * font_height;
+    }
+    int scroll_rows = scroll_offset / font_height;
+    term.snapshot_history_lines = scroll_rows;
+    term.snapshot_view_lines = max_lines;
+
+    // the worker publishes a snapshot when it applies output after the last frame
+    // publish here if it has gone idle with changes since, or history in view is missing
+    std::shared_ptr<const term_snapshot> snapshot = term.LatestSnapshot();
+    size_t view_begin = 0, view_end = 0;
+    if (snapshot) {
+        term_snapshot::HistoryWindow(snapshot->history_size, scroll_rows, max_lines, view_begin, view_end);
+    }
+    if (!snapshot || (term.snapshot_pending && term.snapshot_wanted) ||
+        (view_begin < view_end && (view_begin < snapshot->history_begin ||
+                                   view_end > snapshot->history_begin + snapshot->history.size()))) {
+        term.Publish();
+        snapshot = term.LatestSnapshot();
+    }
+    term.snapshot_wanted = true;
+    pthread_mutex_unlock(&term.lock);
+
+    // geometry is built from the snapshot without lock
+    const term_snapshot &frame = *snapshot;
+
     // clear buffer with background color
     {
-        term_style::color back(predefined_colors[white]);
+        term_style::color back(frame.palette.back);
         glClearColor(back.u.red / 255.0, back.u.green / 255.0, back.u.blue / 255.0, 1.0);
     }
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     // update surface size
-    pthread_mutex_lock(&term.lock);
-    int aligned_width = buffer_width / font_width * font_width;
-    int aligned_height = buffer_height / font_height * font_height;
+    int aligned_width = width / font_width * font_width;
+    int aligned_height = height / font_height * font_height;
     glUniform2f(surface_location, aligned_width, aligned_height);
-    glViewport(0, buffer_height - aligned_height, aligned_width, aligned_height);
+    glViewport(0, height - aligned_height, aligned_width, aligned_height);
 
     // set texture
     glActiveTexture(GL_TEXTURE0);
@@ -1540,7 +3372,6 @@ static void Draw() {
     // bind our vertex array
     glBindVertexArray(vertex_array);
 
-    int max_lines = buffer_height / font_height;
     // vec4 vertex
     static std::vector<GLfloat> vertex_pass0_data;
     static std::vector<GLfloat> vertex_pass1_data;
@@ -1548,124 +3379,194 @@ static void Draw() {
     static std::vector<GLfloat> text_color_data;
     // vec3 backgroundColor
     static std::vector<GLfloat> background_color_data;
+    // underline and strikethrough quads with their color
+    static std::vector<GLfloat> vertex_decoration_data;
+    static std::vector<GLfloat> decoration_color_data;
 
     vertex_pass0_data.clear();
-    vertex_pass0_data.reserve(term.num_rows * term.num_cols * 24);
+    vertex_pass0_data.reserve(frame.num_rows * frame.num_cols * 24);
     vertex_pass1_data.clear();
-    vertex_pass1_data.reserve(term.num_rows * term.num_cols * 24);
+    vertex_pass1_data.reserve(frame.num_rows * frame.num_cols * 24);
     text_color_data.clear();
-    text_color_data.reserve(term.num_rows * term.num_cols * 18);
+    text_color_data.reserve(frame.num_rows * frame.num_cols * 18);
     background_color_data.clear();
-    background_color_data.reserve(term.num_rows * term.num_cols * 18);
-
-    // ensure at least one line shown, for very large scroll_offset
-    int scroll_rows = scroll_offset / font_height;
-    if ((int)term.history.size() + max_lines - 1 - scroll_rows < 0) {
-        scroll_offset = ((int)term.history.size() + max_lines - 1) * font_height;
-        scroll_rows = scroll_offset / font_height;
-    }
+    background_color_data.reserve(frame.num_rows * frame.num_cols * 18);
+    vertex_decoration_data.clear();
+    decoration_color_data.clear();
+
+    auto add_decoration = [](float xpos, float ypos, float w, float h, const GLfloat *color) {
+        GLfloat g_vertex_data[24] = {xpos, ypos + h, 0.0, 0.0, xpos,     ypos, 0.0, 0.0, xpos + w, ypos,     0.0, 0.0,
+                                     xpos, ypos + h, 0.0, 0.0, xpos + w, ypos, 0.0, 0.0, xpos + w, ypos + h, 0.0, 0.0};
+        vertex_decoration_data.insert(vertex_decoration_data.end(), &g_vertex_data[0], &g_vertex_data[24]);
+        for (int i = 0; i < 6; i++) {
+            decoration_color_data.insert(decoration_color_data.end(), color, color + 3);
+        }
+    };
 
     for (int i = 0; i < max_lines; i++) {
         // (aligned_height - font_height) is buffer[0] when scroll_offset is zero
         float x = 0.0;
         float y = aligned_height - (i + 1) * font_height;
         int i_row = i - scroll_rows;
-        std::vector<term_char> row;
-        if (i_row >= 0 && i_row < term.num_rows) {
-            row = term.buffer[i_row];
-        } else if (i_row < 0 && (int)term.history.size() + i_row >= 0) {
-            row = term.history[term.history.size() + i_row];
+        const_term_row row;
+        if (i_row >= 0 && i_row < frame.num_rows) {
+            row = *frame.rows[i_row];
+        } else if (i_row < 0 && (int)frame.history_size + i_row >= 0 &&
+                   frame.HistoryLine(frame.history_size + i_row)) {
+            row = *frame.HistoryLine(frame.history_size + i_row);
         } else {
             continue;
         }
 
         int cur_col = 0;
         for (auto c : row) {
-            uint32_t codepoint = c.code;
-            auto key = std::pair<uint32_t, enum font_class>(c.code, c.style.type);
-            auto it = characters.find(key);
-            if (it == characters.end())
-                it = characters.find(std::make_pair(c.code, font_class::regular));
-            if (it == characters.end()) {
-                // reload font to locate it
-                LOG_WARN("Missing character: %d of class %d", c.code, c.style.type);
-                need_rebuild_atlas = true;
-                codepoints_to_load.insert(c.code);
-
-                // we don't have the character, fallback to .notdef
-                it = characters.find(std::pair<uint32_t, enum font_class>(0, c.style.type));
-                assert(it != characters.end());
+            const term_style &style = frame.Style(c);
+            // palette colors are looked up per frame
+            term_style::color fore(frame.palette.Resolve(style.fore));
+            term_style::color back(frame.palette.Resolve(style.back));
+            if (style.faint) {
+                // faint: halfway to the background
+                fore.set_rgb((fore.bgrz[2] + back.bgrz[2]) / 2, (fore.bgrz[1] + back.bgrz[1]) / 2,
+                             (fore.bgrz[0] + back.bgrz[0]) / 2);
             }
+            // grapheme clusters draw every codepoint in the same cell
+            size_t num_codepoints;
+            const uint32_t *codepoints = frame.Resolve(c.code, num_codepoints);
+            for (size_t j = 0; j < num_codepoints; j++) {
+                uint32_t codepoint = codepoints[j];
+                auto key = std::pair<uint32_t, enum font_class>(codepoint, style.type);
+                auto it = characters.find(key);
+                if (it == characters.end())
+                    it = characters.find(std::make_pair(codepoint, font_class::regular));
+                if (it == characters.end()) {
+                    // reload font to locate it
+                    LOG_WARN("Missing character: %d of class %d", codepoint, style.type);
+                    need_rebuild_atlas = true;
+                    codepoints_to_load.insert(codepoint);
+
+                    // we don't have the character, fallback to .notdef
+                    it = characters.find(std::pair<uint32_t, enum font_class>(0, style.type));
+                    assert(it != characters.end());
+                }
 
-            character ch = it->second;
-            float xpos = x;
-            float ypos = y;
-            float w = font_width;
-            float h = font_height;
-
-            // 1-2
-            // | |
-            // 3-4
-            // (xpos    , ypos + h): 1
-            // (xpos + w, ypos + h): 2
-            // (xpos    , ypos    ): 3
-            // (xpos + w, ypos    ): 4
-
-            // pass 0: draw background
-            GLfloat g_vertex_pass0_data[24] = {// first triangle: 1->3->4
-                                               xpos, ypos + h, 0.0, 0.0, xpos, ypos, 0.0, 0.0, xpos + w, ypos, 0.0, 0.0,
-                                               // second triangle: 1->4->2
-                                               xpos, ypos + h, 0.0, 0.0, xpos + w, ypos, 0.0, 0.0, xpos + w, ypos + h,
-                                               0.0, 0.0};
-            vertex_pass0_data.insert(vertex_pass0_data.end(), &g_vertex_pass0_data[0], &g_vertex_pass0_data[24]);
-
-            // pass 1: draw text
-            xpos = x + ch.xoff;
-            ypos = y + ch.yoff;
-            w = ch.width;
-            h = ch.height;
-            GLfloat g_vertex_pass1_data[24] = {// first triangle: 1->3->4
-                                               xpos, ypos + h, ch.left, ch.top, xpos, ypos, ch.left, ch.bottom,
-                                               xpos + w, ypos, ch.right, ch.bottom,
-                                               // second triangle: 1->4->2
-                                               xpos, ypos + h, ch.left, ch.top, xpos + w, ypos, ch.right, ch.bottom,
-                                               xpos + w, ypos + h, ch.right, ch.top};
-            vertex_pass1_data.insert(vertex_pass1_data.end(), &g_vertex_pass1_data[0], &g_vertex_pass1_data[24]);
-
-            GLfloat g_text_color_buffer_data[18];
-            GLfloat g_background_color_buffer_data[18];
-
-            for (int i = 0; i < 6; i++) {
-                c.style.fore.put_f3(&g_text_color_buffer_data[i*3]);
-                c.style.back.put_f3(&g_background_color_buffer_data[i*3]);
-            }
+                character ch = it->second;
+                float xpos = x;
+                float ypos = y;
+                float w = font_width;
+                float h = font_height;
+
+                // 1-2
+                // | |
+                // 3-4
+                // (xpos    , ypos + h): 1
+                // (xpos + w, ypos + h): 2
+                // (xpos    , ypos    ): 3
+                // (xpos + w, ypos    ): 4
+
+                // pass 0: draw background
+                GLfloat g_vertex_pass0_data[24] = {// first triangle: 1->3->4
+                                                   xpos, ypos + h, 0.0, 0.0, xpos, ypos, 0.0, 0.0, xpos + w, ypos, 0.0, 0.0,
+                                                   // second triangle: 1->4->2
+                                                   xpos, ypos + h, 0.0, 0.0, xpos + w, ypos, 0.0, 0.0, xpos + w, ypos + h,
+                                                   0.0, 0.0};
+                vertex_pass0_data.insert(vertex_pass0_data.end(), &g_vertex_pass0_data[0], &g_vertex_pass0_data[24]);
+
+                // pass 1: draw text
+                xpos = x + ch.xoff;
+                if (j > 0 && ch.xoff + ch.width <= 0) {
+                    // zero advance combining mark placed over the previous glyph
+                    xpos += font_width;
+                }
+                ypos = y + ch.yoff;
+                w = ch.width;
+                h = ch.height;
+                GLfloat g_vertex_pass1_data[24] = {// first triangle: 1->3->4
+                                                   xpos, ypos + h, ch.left, ch.top, xpos, ypos, ch.left, ch.bottom,
+                                                   xpos + w, ypos, ch.right, ch.bottom,
+                                                   // second triangle: 1->4->2
+                                                   xpos, ypos + h, ch.left, ch.top, xpos + w, ypos, ch.right, ch.bottom,
+                                                   xpos + w, ypos + h, ch.right, ch.top};
+                vertex_pass1_data.insert(vertex_pass1_data.end(), &g_vertex_pass1_data[0], &g_vertex_pass1_data[24]);
+
+                GLfloat g_text_color_buffer_data[18];
+                GLfloat g_background_color_buffer_data[18];
+
+                for (int i = 0; i < 6; i++) {
+                    fore.put_f3(&g_text_color_buffer_data[i*3]);
+                    back.put_f3(&g_background_color_buffer_data[i*3]);
+                }
 
-            if (term.reverse_video ^
-(term.show_cursor && i_row == term.row &&
-(cur_col == term.col || (codepoint == term_char::WIDE_TAIL && cur_col == term.col+1)))) {
-                // invert text and bg colors
-                for (int i = 0; i < 18; i++) {
-                    g_text_color_buffer_data[i] = 1.0 - g_text_color_buffer_data[i];
-                    g_background_color_buffer_data[i] = 1.0 - g_background_color_buffer_data[i];
+                if (frame.reverse_video ^
+(frame.show_cursor && i_row == frame.row &&
+(cur_col == frame.col || (codepoint == term_char::WIDE_TAIL && cur_col == frame.col+1)))) {
+                    // invert text and bg colors
+                    for (int i = 0; i < 18; i++) {
+                        g_text_color_buffer_data[i] = 1.0 - g_text_color_buffer_data[i];
+                        g_background_color_buffer_data[i] = 1.0 - g_background_color_buffer_data[i];
+                    }
                 }
-            }
 
-            // blink: every 0.5s in 1s, text color = background color
-            if (c.style.blink && current_msec % 1000 > 500) {
-                for (int i = 0; i < 18; i++) {
-                    g_text_color_buffer_data[i] = g_background_color_buffer_data[i];
+                // blink: every 0.5s in 1s, text color = background color
+                if (style.blink && current_msec % 1000 > 500) {
+                    for (int i = 0; i < 18; i++) {
+                        g_text_color_buffer_data[i] = g_background_color_buffer_data[i];
+                    }
                 }
-            }
 
-            text_color_data.insert(text_color_data.end(), &g_text_color_buffer_data[0], &g_text_color_buffer_data[18]);
-            background_color_data.insert(background_color_data.end(), &g_background_color_buffer_data[0],
-                                         &g_background_color_buffer_data[18]);
+                // decorations once per cell, in the final text color unless the underline has its own
+                if (j == 0 && (style.underline != term_style::underline_none || style.strikethrough)) {
+                    float thickness = std::max(1, font_height / 20);
+                    if (style.underline != term_style::underline_none) {
+                        GLfloat underline_color[3];
+                        if (style.underline_color.u.tag == term_style::tag_default_fore) {
+                            std::copy(&g_text_color_buffer_data[0], &g_text_color_buffer_data[3], underline_color);
+                        } else {
+                            term_style::color(frame.palette.Resolve(style.underline_color)).put_f3(underline_color);
+                        }
+                        float underline_y = y + baseline_height - 2 * thickness;
+                        if (style.underline == term_style::underline_curly) {
+                            // a sine wave of one period per cell, in steps of the line thickness
+                            float amplitude = std::min(thickness, underline_y - y);
+                            for (float dx = 0; dx < font_width; dx += thickness) {
+                                float dy = amplitude * std::sin(2 * (float)M_PI * (dx + thickness / 2) / font_width);
+                                add_decoration(x + dx, underline_y + dy, std::min(thickness, font_width - dx),
+                                               thickness, underline_color);
+                            }
+                        } else if (style.underline == term_style::underline_dotted ||
+                                   style.underline == term_style::underline_dashed) {
+                            // segments continue across cells: dots as long as the gaps between them,
+                            // or a dash over the middle half of each cell
+                            bool dotted = style.underline == term_style::underline_dotted;
+                            float period = dotted ? 2 * thickness : font_width;
+                            float length = dotted ? thickness : font_width / 2.0f;
+                            float start = dotted ? -std::fmod(x, period) : font_width / 4.0f;
+                            for (float dx = start; dx < font_width; dx += period) {
+                                float begin = std::max(dx, 0.0f), end = std::min(dx + length, (float)font_width);
+                                if (begin < end) {
+                                    add_decoration(x + begin, underline_y, end - begin, thickness, underline_color);
+                                }
+                            }
+                        } else {
+                            add_decoration(x, underline_y, font_width, thickness, underline_color);
+                            if (style.underline == term_style::underline_double) {
+                                add_decoration(x, underline_y - 2 * thickness, font_width, thickness, underline_color);
+                            }
+                        }
+                    }
+                    if (style.strikethrough) {
+                        add_decoration(x, y + baseline_height + (font_height - baseline_height) / 3, font_width,
+                                       thickness, g_text_color_buffer_data);
+                    }
+                }
 
+                text_color_data.insert(text_color_data.end(), &g_text_color_buffer_data[0], &g_text_color_buffer_data[18]);
+                background_color_data.insert(background_color_data.end(), &g_background_color_buffer_data[0],
+                                             &g_background_color_buffer_data[18]);
+            }
             x += font_width;
             cur_col++;
         }
     }
-    pthread_mutex_unlock(&term.lock);
 
     // draw in two pass
     glBindBuffer(GL_ARRAY_BUFFER, text_color_buffer);
@@ -1686,6 +3587,21 @@ static void Draw() {
     glUniform1i(render_pass_location, 1);
     glDrawArrays(GL_TRIANGLES, 0, vertex_pass1_data.size() / 4);
 
+    // decorations over the text, solid like the first pass
+    if (!vertex_decoration_data.empty()) {
+        glBindBuffer(GL_ARRAY_BUFFER, text_color_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * decoration_color_data.size(), decoration_color_data.data(),
+                     GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, background_color_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * decoration_color_data.size(), decoration_color_data.data(),
+                     GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * vertex_decoration_data.size(), vertex_decoration_data.data(),
+                     GL_STREAM_DRAW);
+        glUniform1i(render_pass_location, 0);
+        glDrawArrays(GL_TRIANGLES, 0, vertex_decoration_data.size() / 4);
+    }
+
     glBindVertexArray(0);
     glBindTexture(GL_TEXTURE_2D, 0);
     glFlush();
@@ -1893,13 +3809,24 @@ void main() {
 }
 
 
-// on resize
+// on resize, a window drag calls this many times per frame
 void Resize(int new_width, int new_height) {
     pthread_mutex_lock(&term.lock);
     buffer_width = new_width;
     buffer_height = new_height;
+    resize_pending = true;
+    pthread_mutex_unlock(&term.lock);
+}
+
+void SetResizeDelay(int msec) {
+    pthread_mutex_lock(&term.lock);
+    term.resize_delay_msec = std::max(msec, 0);
+    pthread_mutex_unlock(&term.lock);
+}
 
-    ResizeTo(buffer_height / font_height, buffer_width / font_width, false);
+void SetAmbiguousWide(bool wide) {
+    pthread_mutex_lock(&term.lock);
+    term.SetAmbiguousWide(wide);
     pthread_mutex_unlock(&term.lock);
 }
 
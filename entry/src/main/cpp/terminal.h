@@ -1,9 +1,16 @@
 #ifndef __TERMINAL_H__
 #define __TERMINAL_H__
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
 #include <cstdint>
-#include <deque>
+#include <cstring>
+#include <map>
+#include <memory>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include <stdlib.h>
 #include <optional>
@@ -39,6 +46,15 @@ enum term_colors {
 #define PACK_RGB(r,g,b) ((uint32_t(r&0xff)<<16) | (uint32_t(g&0xff)<<8) | uint32_t(b)&0xff)
 // maintain terminal status
 struct term_style {
+    // a color is rgb, or refers to the palette and is resolved when drawn
+    // so changing the palette recolors existing content
+    enum color_tag : uint8_t {
+        tag_rgb = 0,
+        // palette index in the lowest byte
+        tag_palette = 1,
+        tag_default_fore = 2,
+        tag_default_back = 3,
+    };
     struct color {
         union {
             uint32_t value;
@@ -46,7 +62,8 @@ struct term_style {
                 uint8_t blue;
                 uint8_t green;
                 uint8_t red;
-                uint8_t zero;
+                // one of color_tag
+                uint8_t tag;
             } u;
             uint8_t bgrz[4];
         };
@@ -67,31 +84,395 @@ struct term_style {
             value = val;
             return * this;
         }
+        static inline color Palette(uint8_t index) { return color((uint32_t)tag_palette << 24 | index); }
+        static inline color DefaultFore() { return color((uint32_t)tag_default_fore << 24); }
+        static inline color DefaultBack() { return color((uint32_t)tag_default_back << 24); }
+    };
+    // SGR 4 : Ps, none to dashed
+    enum underline_style : uint8_t {
+        underline_none = 0,
+        underline_single = 1,
+        underline_double = 2,
+        underline_curly = 3,
+        underline_dotted = 4,
+        underline_dashed = 5,
+        NUM_UNDERLINE_STYLE,
     };
     color fore, back;
     font_class type = regular;
     // blinking
     bool blink = false;
+    // rare decorations live here rather than in term_char:
+    // cells only store a style id, so decorated cells cost no more than colored ones
+    underline_style underline = underline_none;
+    bool strikethrough = false;
+    bool faint = false;
+    // DefaultFore draws the underline in the text color
+    color underline_color;
     // constuctor
     term_style();
+
+    inline bool operator==(const term_style &other) const {
+        return fore.value == other.fore.value && back.value == other.back.value && type == other.type &&
+               blink == other.blink && underline == other.underline && strikethrough == other.strikethrough &&
+               faint == other.faint && underline_color.value == other.underline_color.value;
+    }
 };
 
-// character in terminal
+// character in terminal, copied and moved as plain bytes
 struct term_char {
     // way beyond valid utf8
     static constexpr uint32_t
         WIDE_TAIL = 'wcht';
+    // codes from CLUSTER_BASE refer to grapheme clusters in grapheme_table
+    static constexpr uint32_t
+        CLUSTER_BASE = 0x80000000;
     uint32_t code = ' ';
-    term_style style;
+    // index into style_table, 0 is the default style
+    uint32_t style_id = 0;
+};
+static_assert(std::is_trivially_copyable<term_char>::value, "term_char is moved with memmove");
+
+// distinct styles used by cells, so a cell stores an id instead of a full term_style
+struct style_table {
+    // bound memory, new styles fall back to the default style beyond
+    static constexpr size_t MAX_STYLES = 65536;
+
+    // styles by id, stale if freed
+    std::vector<term_style> styles;
+    // interned styles to id, packed as (fore, back) and (underline color, type, decorations, blink)
+    std::map<std::pair<uint64_t, uint64_t>, uint32_t> ids;
+    // freed ids for reuse
+    std::vector<uint32_t> free_list;
+    // bumped when an id gets a new style, so snapshots can share an unchanged table
+    uint64_t version = 0;
+    // a sweep costs the same whether it frees anything or not,
+    // so a full table is swept at most once per SWEEP_INTERVAL new or failed interns
+    static constexpr size_t SWEEP_INTERVAL = MAX_STYLES / 16;
+    size_t interns_since_sweep = SWEEP_INTERVAL;
+
+    style_table();
+
+    static inline std::pair<uint64_t, uint64_t> Key(const term_style &style) {
+        return {(uint64_t)style.fore.value << 32 | style.back.value,
+                (uint64_t)style.underline_color.value << 32 | (uint32_t)style.type << 8 | style.underline << 3 |
+                    style.strikethrough << 2 | style.faint << 1 | style.blink};
+    }
+
+    // returns the id of the style, or zero if the table is full
+    uint32_t Intern(const term_style &style);
+
+    inline const term_style &Get(uint32_t id) const { return styles[id]; }
+
+    // free styles whose id is not marked as used
+    void Sweep(const std::vector<bool> &used);
+    inline bool SweepDue() const { return interns_since_sweep >= SWEEP_INTERVAL; }
+};
+
+// grapheme clusters of more than one codepoint, e.g. combining marks and ZWJ emoji sequences
+// cells store CLUSTER_BASE + index, so only cells with clusters pay for extra storage
+struct grapheme_table {
+    // bound memory, further codepoints are dropped
+    static constexpr size_t MAX_CLUSTERS = 16384;
+    static constexpr size_t MAX_CLUSTER_LENGTH = 16;
+
+    // codepoints by index, empty if freed
+    std::vector<std::vector<uint32_t>> clusters;
+    // interned clusters to code
+    std::map<std::vector<uint32_t>, uint32_t> codes;
+    // freed indices for reuse
+    std::vector<uint32_t> free_list;
+    // bumped when an index gets a new cluster, so snapshots can share an unchanged table
+    uint64_t version = 0;
+    // a full table is swept at most once per SWEEP_INTERVAL new or failed interns, see style_table
+    static constexpr size_t SWEEP_INTERVAL = MAX_CLUSTERS / 16;
+    size_t interns_since_sweep = SWEEP_INTERVAL;
+
+    static bool IsCluster(uint32_t code) { return code >= term_char::CLUSTER_BASE; }
+
+    // returns the code of the cluster, or zero if the table is full
+    uint32_t Intern(const std::vector<uint32_t> &cluster);
+
+    // codepoints in a cell: the cluster, or the code itself
+    const uint32_t *Resolve(const uint32_t &code, size_t &length) const { return Resolve(clusters, code, length); }
+    static const uint32_t *Resolve(const std::vector<std::vector<uint32_t>> &clusters, const uint32_t &code,
+                                   size_t &length);
+
+    // free clusters whose index is not marked as used
+    void Sweep(const std::vector<bool> &used);
+    inline bool SweepDue() const { return interns_since_sweep >= SWEEP_INTERVAL; }
+};
+
+// colors referenced by term_style::color, looked up when drawing
+struct term_palette {
+    // 0..15 are the ansi colors, 16..255 the xterm 256 color cube and grayscale
+    uint32_t colors[256];
+    uint32_t fore;
+    uint32_t back;
+
+    term_palette();
+
+    inline uint32_t Resolve(term_style::color color) const {
+        switch (color.u.tag) {
+        case term_style::tag_palette:
+            return colors[color.value & 0xff];
+        case term_style::tag_default_fore:
+            return fore;
+        case term_style::tag_default_back:
+            return back;
+        default:
+            return color.value;
+        }
+    }
+};
+
+// view of a row of cells, in the screen grid or a history line
+template <typename T>
+struct row_view {
+    T *cells = nullptr;
+    int length = 0;
+
+    row_view() = default;
+    row_view(T *cells, int length) : cells(cells), length(length) {}
+    row_view(std::vector<term_char> &line) : cells(line.data()), length(line.size()) {}
+    row_view(const std::vector<term_char> &line) : cells(line.data()), length(line.size()) {}
+    // mutable view converts to const view
+    row_view(const row_view<term_char> &other) : cells(other.cells), length(other.length) {}
+
+    inline T &operator[](int i) const { return cells[i]; }
+    inline int size() const { return length; }
+    inline T *begin() const { return cells; }
+    inline T *end() const { return cells + length; }
+};
+typedef row_view<term_char> term_row;
+typedef row_view<const term_char> const_term_row;
+
+// visible rows of the terminal in one allocation,
+// scrolled by moving row indices instead of rows
+struct term_grid {
+    // row r in storage order starts at cells[r * stride]
+    std::vector<term_char> cells;
+    int stride = 0;
+    // screen row i is row index[i] in storage
+    std::vector<int> index;
+    // row r in storage order was soft-wrapped into the next screen row, see Wrapped() and Padded()
+    std::vector<uint8_t> wrapped;
+    // a row of blank_value, copied in bulk instead of filling cell by cell
+    std::vector<term_char> blank;
+    term_char blank_value;
+
+    inline term_row operator[](int i) { return term_row(cells.data() + index[i] * stride, stride); }
+    inline const_term_row operator[](int i) const {
+        return const_term_row(cells.data() + index[i] * stride, stride);
+    }
+    inline int size() const { return index.size(); }
+
+    // screen row i was filled up by autowrap and continues in the next row,
+    // kept until the row is cleared and used to rejoin lines on resize
+    inline bool Wrapped(int i) const { return wrapped[index[i]] & 1; }
+    // the last cell of a wrapped row is a blank that reflow put before a wide char, not content
+    inline bool Padded(int i) const { return wrapped[index[i]] & 2; }
+    inline void SetWrapped(int i, bool value, bool padded = false) { wrapped[index[i]] = value | padded << 1; }
+
+    // resize to num_rows x num_cols, keeping content from the top left
+    void Resize(int num_rows, int num_cols);
+
+    // fill columns [begin, end) of screen row i with a blank cell
+    inline void Fill(int i, int begin, int end, term_char value) {
+        if (value.code != blank_value.code || value.style_id != blank_value.style_id) {
+            blank_value = value;
+            std::fill(blank.begin(), blank.end(), value);
+        }
+        memcpy(cells.data() + index[i] * stride + begin, blank.data(), (end - begin) * sizeof(term_char));
+    }
+    // copy columns [begin, end) of screen row from to start at column dest of screen row to, ranges may overlap
+    inline void Copy(int from, int begin, int end, int to, int dest) {
+        memmove(cells.data() + index[to] * stride + dest, cells.data() + index[from] * stride + begin,
+                (end - begin) * sizeof(term_char));
+    }
+
+    inline void ClearRow(int i, term_char value) {
+        Fill(i, 0, stride, value);
+        wrapped[index[i]] = false;
+    }
+
+    // move columns [begin, end) of screen row i to start at column dest, ranges may overlap
+    inline void Move(int i, int begin, int end, int dest) {
+        term_char *line = cells.data() + index[i] * stride;
+        memmove(line + dest, line + begin, (end - begin) * sizeof(term_char));
+    }
+
+    // rotate screen rows in [first, last) like std::rotate, so middle becomes first
+    inline void Rotate(int first, int middle, int last) {
+        std::rotate(index.begin() + first, index.begin() + middle, index.begin() + last);
+    }
+};
+
+// a line of scrollback, as wide as the screen when it was written or last reflowed
+struct history_line {
+    std::vector<term_char> cells;
+    // continues in the next line, see term_grid::Wrapped()
+    bool wrapped = false;
+    // see term_grid::Padded()
+    bool padded = false;
+    // a wrapped line was cut here when rewrapped, reflow treats it as a line end, see ReflowScreen()
+    bool split = false;
+    // copy of cells shared with snapshots, reset when the slot is reused
+    std::shared_ptr<const std::vector<term_char>> shared;
+};
+
+// scrollback lines, oldest first, in a ring of slots that keep their cell storage,
+// so a line scrolled into full history reuses the storage of the line it evicts
+struct history_ring {
+    // bound memory, the oldest lines are dropped beyond
+    static constexpr size_t MAX_LINES = 5000;
+
+    // slots [count, slots.size()) after the latest line are spare and keep their storage
+    std::vector<history_line> slots;
+    // slot of the oldest line
+    size_t head = 0;
+    size_t count = 0;
+
+    // lines pushed that had to allocate cells, and that reused a recycled slot
+    size_t allocations = 0;
+    size_t reuses = 0;
+
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+    inline history_line &operator[](size_t i) { return slots[(head + i) % slots.size()]; }
+    inline const history_line &operator[](size_t i) const { return slots[(head + i) % slots.size()]; }
+    inline history_line &front() { return (*this)[0]; }
+    inline history_line &back() { return (*this)[count - 1]; }
+
+    // append a line of width cells to fill in, dropping the oldest line when full
+    history_line &PushBack(int width);
+    // drop the oldest line, its slot becomes spare
+    void PopFront();
+    // remove lines [first, last), their slots become spare
+    void Erase(size_t first, size_t last);
+    // insert lines before pos, dropping the oldest beyond MAX_LINES
+    // returns where the inserted lines start now
+    size_t Insert(size_t pos, std::vector<history_line> &lines);
+
+  private:
+    // add a spare slot, with the oldest line moved to the first slot
+    void Grow();
+};
+
+// tab stops as bits, searched a word at a time
+struct tab_stop_set {
+    std::vector<uint64_t> words;
+    int num_cols = 0;
+
+    // keep stops in remaining columns, new columns get a stop every tab_size
+    void Resize(int new_num_cols, int tab_size);
+
+    inline void Set(int col) {
+        if (col >= 0 && col < num_cols) {
+            words[col >> 6] |= 1ull << (col & 63);
+        }
+    }
+    inline void Clear(int col) {
+        if (col >= 0 && col < num_cols) {
+            words[col >> 6] &= ~(1ull << (col & 63));
+        }
+    }
+    inline void ClearAll() { std::fill(words.begin(), words.end(), 0); }
+    inline bool Has(int col) const { return col >= 0 && col < num_cols && (words[col >> 6] >> (col & 63)) & 1; }
+
+    // first stop after col, or the last column if none
+    int Next(int col) const;
+    // last stop before col, or the first column if none
+    int Prev(int col) const;
+};
+
+// immutable copy of what is drawn, published by the terminal and read by the renderer without lock
+// unchanged rows and tables are shared with the previous snapshot
+struct term_snapshot {
+    typedef std::shared_ptr<const std::vector<term_char>> shared_row;
+
+    int num_rows = 0;
+    int num_cols = 0;
+    // cursor
+    int row = 0;
+    int col = 0;
+    bool show_cursor = true;
+    bool reverse_video = false;
+
+    // screen rows
+    std::vector<shared_row> rows;
+    // history lines in view when published, oldest first, see HistoryWindow()
+    std::vector<shared_row> history;
+    // index of history[0] among all history lines
+    size_t history_begin = 0;
+    // number of history lines in the terminal
+    size_t history_size = 0;
+
+    term_palette palette;
+    std::shared_ptr<const std::vector<term_style>> styles;
+    std::shared_ptr<const std::vector<std::vector<uint32_t>>> clusters;
+
+    inline const term_style &Style(const term_char &c) const { return (*styles)[c.style_id]; }
+    // history line at index among all history lines, nullptr if not published
+    inline const std::vector<term_char> *HistoryLine(size_t index) const {
+        if (index < history_begin || index - history_begin >= history.size()) {
+            return nullptr;
+        }
+        return history[index - history_begin].get();
+    }
+    // history lines [begin, end) in view when scrolled up by scroll_lines with view_lines on screen
+    static inline void HistoryWindow(size_t size, size_t scroll_lines, size_t view_lines, size_t &begin,
+                                     size_t &end) {
+        begin = size - std::min(scroll_lines, size);
+        end = begin + std::min(view_lines, size - begin);
+    }
+    inline const uint32_t *Resolve(const uint32_t &code, size_t &length) const {
+        return grapheme_table::Resolve(*clusters, code, length);
+    }
+};
+
+// cells changed since the last terminal_context::TakeDamage()
+struct term_damage {
+    // changed columns [begin, end) of a screen row, none if begin >= end
+    struct span {
+        int begin = INT_MAX;
+        int end = 0;
+    };
+    std::vector<span> rows;
+    // redraw everything, e.g. after resize or palette change
+    bool full = false;
+
+    inline void Add(int row, int begin, int end) {
+        span &s = rows[row];
+        s.begin = std::min(s.begin, begin);
+        s.end = std::max(s.end, end);
+    }
+    // whole rows in [first, last)
+    void AddRows(int first, int last, int num_cols);
+    inline void AddAll() { full = true; }
+    bool Empty() const;
+    // no damage for num_rows rows
+    void Reset(int num_rows);
 };
 
 // escape sequence state machine
+// https://vt100.net/emu/dec_ansi_parser
 enum escape_states {
-    state_idle,
-    state_esc,
-    state_csi,
-    state_osc,
-    state_dcs,
+    state_ground,
+    state_escape,
+    state_escape_intermediate,
+    state_csi_entry,
+    state_csi_param,
+    state_csi_intermediate,
+    state_csi_ignore,
+    state_dcs_entry,
+    state_dcs_param,
+    state_dcs_intermediate,
+    state_dcs_passthrough,
+    state_dcs_ignore,
+    state_osc_string,
+    state_sos_pm_apc_string,
+    NUM_ESCAPE_STATES,
 };
 
 // utf8 decode state machine
@@ -108,6 +489,246 @@ enum utf8_states {
     state_4byte_4,        // expected 4th byte of 4-byte sequence
 };
 
+// parameters of CSI escape sequence, parsed in place without allocation
+struct csi_params {
+    static constexpr int MAX_PARAMS = 32;
+    static constexpr int MAX_INTERMEDIATES = 2;
+    static constexpr int MAX_VALUE = 65535;
+    // raw bytes kept for logging
+    static constexpr int MAX_RAW = 64;
+
+    // numeric parameters, -1 if omitted
+    int params[MAX_PARAMS];
+    int count = 0;
+    // bit i is set if params[i] is a sub-parameter, i.e. follows ':'
+    uint32_t sub_mask = 0;
+    // one of '<', '=', '>', '?', or zero
+    uint8_t private_marker = 0;
+    uint8_t intermediates[MAX_INTERMEDIATES];
+    int num_intermediates = 0;
+    // raw parameter and intermediate bytes, truncated to MAX_RAW
+    char raw[MAX_RAW + 1] = {};
+    int length = 0;
+
+    // parser state
+    int current = -1;
+    bool next_sub = false;
+    bool has_params = false;
+    bool malformed = false;
+
+    // reset for a new sequence
+    void Clear();
+    // feed a parameter or intermediate byte
+    void Put(uint8_t byte);
+    // called before dispatching the final byte
+    void Finish();
+    void Push();
+
+    // get parameter, or the default value if omitted
+    inline int Get(int index, int def) const {
+        return index < count && params[index] >= 0 ? params[index] : def;
+    }
+    inline bool IsSub(int index) const {
+        return index < count && (sub_mask >> index) & 1;
+    }
+};
+
+// effect of a SGR sequence on a style, independent of the style it is applied to
+struct sgr_delta {
+    // each color ends up as the old foreground, the old background or a constant
+    enum color_source : uint8_t { from_fore, from_back, from_constant };
+    color_source fore_source = from_fore;
+    color_source back_source = from_back;
+    term_style::color fore, back;
+    // others are kept or set
+    bool keep_type = true;
+    bool keep_blink = true;
+    bool keep_underline = true;
+    bool keep_strikethrough = true;
+    bool keep_faint = true;
+    bool keep_underline_color = true;
+    font_class type = regular;
+    bool blink = false;
+    term_style::underline_style underline = term_style::underline_none;
+    bool strikethrough = false;
+    bool faint = false;
+    term_style::color underline_color;
+
+    inline void Apply(term_style &style) const {
+        term_style::color old_fore = style.fore, old_back = style.back;
+        style.fore = fore_source == from_fore ? old_fore : fore_source == from_back ? old_back : fore;
+        style.back = back_source == from_fore ? old_fore : back_source == from_back ? old_back : back;
+        if (!keep_type) style.type = type;
+        if (!keep_blink) style.blink = blink;
+        if (!keep_underline) style.underline = underline;
+        if (!keep_strikethrough) style.strikethrough = strikethrough;
+        if (!keep_faint) style.faint = faint;
+        if (!keep_underline_color) style.underline_color = underline_color;
+    }
+};
+
+// memoize SGR: map raw parameter bytes to the resulting delta
+struct sgr_cache {
+    static constexpr int NUM_SETS = 32;
+    static constexpr int NUM_WAYS = 2;
+
+    struct entry {
+        bool valid = false;
+        uint8_t length = 0;
+        // raw parameter bytes, first 16 bytes zero padded
+        uint64_t head = 0;
+        uint64_t tail = 0;
+        char rest[csi_params::MAX_RAW - 16];
+        sgr_delta delta;
+    };
+    // set associative by hash of raw bytes, most recently used first
+    entry entries[NUM_SETS * NUM_WAYS];
+
+    // counters to check hit rate
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    // find the entry for the sequence, returns nullptr if not cacheable
+    // on a miss, the entry is claimed and the caller fills its delta
+    entry *Lookup(const csi_params &csi, bool &hit);
+};
+
+// what to do when an OSC/DCS payload exceeds its size limit
+enum payload_policy {
+    // ignore the whole sequence
+    policy_drop,
+    // handle the bytes within the limit
+    policy_truncate,
+};
+
+struct payload_limit {
+    size_t max_length;
+    payload_policy policy;
+};
+
+// OSC/DCS payload, passed to handlers in fixed size chunks
+// so that memory usage does not depend on the sequence length
+struct string_payload {
+    static constexpr size_t CHUNK_SIZE = 256;
+
+    uint8_t chunk[CHUNK_SIZE];
+    size_t chunk_length = 0;
+    // bytes accepted so far
+    size_t length = 0;
+    payload_limit limit = {0, policy_drop};
+    // set when bytes beyond the limit are discarded
+    bool overflow = false;
+
+    // reset for a new sequence
+    void Clear(payload_limit new_limit) {
+        chunk_length = 0;
+        length = 0;
+        limit = new_limit;
+        overflow = false;
+    }
+    // whether the handler should act on the sequence
+    inline bool Accepted() const {
+        return !overflow || limit.policy == policy_truncate;
+    }
+};
+
+// tokens produced by the tokenizer
+enum vt_token_type : uint8_t {
+    // run of printable ascii in token_batch::text
+    token_print_ascii,
+    // run of decoded codepoints in token_batch::codepoints
+    token_print_codepoints,
+    // C0 control character
+    token_control,
+    // escape sequence without CSI/OSC/DCS, parameters in token_batch::params
+    token_esc,
+    // CSI escape sequence, parameters in token_batch::params
+    token_csi,
+    // OSC escape sequence in token_batch::osc
+    token_osc,
+};
+
+struct vt_token {
+    vt_token_type type;
+    // control character or final byte
+    uint8_t byte;
+    // range in the storage of the token type
+    uint32_t offset;
+    uint32_t length;
+};
+
+// tokens from a chunk of pty output, applied to the terminal in order
+struct token_batch {
+    std::vector<vt_token> tokens;
+    std::vector<uint8_t> text;
+    std::vector<uint32_t> codepoints;
+    std::vector<csi_params> params;
+    // OSC Ps and data
+    std::vector<std::pair<int, std::string>> osc;
+
+    // keep capacity for the next batch
+    void Clear();
+    // consecutive printable characters are merged into one token
+    void PushText(const uint8_t *data, size_t length);
+    void PushCodepoints(const uint32_t *data, size_t length);
+    void PushControl(uint8_t input);
+    void PushSequence(vt_token_type type, const csi_params &csi, uint8_t current);
+    void PushOSC(int command, std::string data);
+};
+
+// first stage of parsing: turn pty output into tokens,
+// without touching the terminal state, thus runs without lock
+struct vt_tokenizer {
+    // escape sequence state machine
+    escape_states escape_state = state_ground;
+    csi_params csi;
+
+    // OSC/DCS payload
+    string_payload payload;
+    // OSC Ps, -1 while parsing and -2 if invalid
+    int osc_command = -1;
+    int osc_number = 0;
+    // data of supported OSC commands collected from chunks, bounded by the limits
+    std::string osc_data;
+    // DCS final byte
+    uint8_t dcs_final = 0;
+    // limits of OSC/DCS payload, OSC 52 carries clipboard content thus has its own
+    payload_limit osc_limit = {4096, policy_truncate};
+    payload_limit clipboard_limit = {1 << 20, policy_drop};
+    payload_limit dcs_limit = {4096, policy_drop};
+
+    // utf8 decode state machine
+    utf8_states utf8_state = state_initial;
+    uint32_t current_utf8 = 0;
+
+    // tokenize a chunk of pty output, with fast path for printable ascii and utf8
+    void Tokenize(const uint8_t *data, size_t length, token_batch &batch);
+
+    // tokenize byte by byte
+    void Put(uint8_t input, token_batch &batch);
+
+    // decode utf8 byte by byte
+    void DecodeUtf8(uint8_t input, token_batch &batch);
+
+    // feed a byte of OSC/DCS payload
+    void PutPayload(uint8_t input);
+
+    // pass buffered payload to the OSC/DCS handler
+    void FlushPayload();
+
+    // handle a chunk of OSC payload
+    void HandleOSCChunk(const uint8_t *data, size_t length);
+
+    // OSC terminated, emit token if supported
+    void EndOSC(token_batch &batch);
+
+    // handle a chunk of DCS payload
+    void HandleDCSChunk(const uint8_t *data, size_t length);
+
+    // DCS terminated
+    void EndDCS();
+};
+
 struct terminal_context {
     // protect multithreaded usage
     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
@@ -115,13 +736,41 @@ struct terminal_context {
     // pty
     int fd = -1;
 
-    // escape sequence state machine
-    escape_states escape_state = state_idle;
-    std::string escape_buffer;
+    // parser state, only used by the worker thread and not protected by lock
+    vt_tokenizer tokenizer;
+    token_batch batch;
 
-    // utf8 decode state machine
-    utf8_states utf8_state = state_initial;
-    uint32_t current_utf8 = 0;
+    // width table for the current east asian ambiguous width setting
+    const uint16_t *width_index = nullptr;
+
+    // grapheme clusters referenced by cells in buffer and history
+    grapheme_table graphemes;
+
+    // colors used to draw palette and default colors, see OSC 4/10/11
+    term_palette palette;
+
+    // changed cells for incremental consumers, see TakeDamage()
+    term_damage damage;
+
+    // latest frame snapshot, see Publish()
+    // load and store with std::atomic_load/std::atomic_store
+    std::shared_ptr<const term_snapshot> snapshot;
+    // screen content changed since the snapshot was published
+    std::atomic<bool> snapshot_pending{true};
+    // the renderer has taken the snapshot and wants the next one
+    std::atomic<bool> snapshot_wanted{true};
+    // history lines the renderer is scrolled up by, and rows it shows from there
+    std::atomic<int> snapshot_history_lines{0};
+    std::atomic<int> snapshot_view_lines{INT_MAX};
+    // rows of the last snapshot by storage row in buffer, reused if unchanged
+    std::vector<term_snapshot::shared_row> snapshot_rows;
+    // history window of the last snapshot, lines leaving it drop their shared copy
+    size_t snapshot_history_begin = 0;
+    size_t snapshot_history_end = 0;
+    std::shared_ptr<const std::vector<term_style>> snapshot_styles;
+    uint64_t snapshot_styles_version = 0;
+    std::shared_ptr<const std::vector<std::vector<uint32_t>>> snapshot_clusters;
+    uint64_t snapshot_clusters_version = 0;
 
     // DEC private modes
     // DECTCEM, Show cursor
@@ -138,7 +787,7 @@ struct terminal_context {
     // tab handling
     int tab_size = 8;
     // columns where tab stops
-    std::vector<bool> tab_stops;
+    tab_stop_set tab_stops;
 
     // save/restore feature
     int save_row = 0;
@@ -146,11 +795,30 @@ struct terminal_context {
     term_style save_style;
     // current text style, see CSI Pm M, SGR
     term_style current_style;
+    // last printed character, repeated by REP
+    uint32_t last_codepoint = 0;
+    // recently applied SGR sequences
+    sgr_cache sgr;
+    // styles referenced by cells in buffer and history
+    style_table styles;
+    // id of current_style, interned when cells are written
+    uint32_t current_style_id = 0;
+    term_style interned_style;
+    // cell for erased and scrolled in areas, with the current background color (BCE)
+    term_char blank;
+    term_style::color blank_back = term_style::color::DefaultBack();
 
     // scrollback history, only if exceeds buffer
-    std::deque<std::vector<term_char>> history;
+    history_ring history;
+    // lines before this index may still have the width before the last resize,
+    // they are reflowed on demand when scrolled into view, see ReflowHistory()
+    size_t history_stale = 0;
     // terminal content, limited to rows & cols
-    std::vector<std::vector<term_char>> buffer;
+    term_grid buffer;
+    // the other screen, preallocated and swapped with buffer, see DECSET 47/1047/1049
+    term_grid alt_buffer;
+    // buffer is the alternate screen, which never scrolls into history
+    bool alternate_screen = false;
     // terminal size
     int num_cols = 0;
     int num_rows = 0;
@@ -162,12 +830,103 @@ struct terminal_context {
     int scroll_top = 0;
     int scroll_bottom = num_rows - 1;
 
+    // size last reported to the pty with TIOCSWINSZ, see ReportSize()
+    int winsize_rows = 0;
+    int winsize_cols = 0;
+    // time of the last ResizeTo() in milliseconds
+    uint64_t resize_msec = 0;
+    // trailing delay before a new size is reported, so a window drag sends one SIGWINCH
+    int resize_delay_msec = 100;
+
+    terminal_context();
+
+    // treat east asian ambiguous characters as wide or narrow
+    void SetAmbiguousWide(bool wide);
+    // width of the codepoint as utf8proc_charwidth() gives it, negative as zero
+    int CharWidth(uint32_t codepoint) const;
+
+    // resize the grid, the pty learns the new size later from ReportSize()
     void ResizeTo(int new_term_row, int new_term_col);
 
+    // send the size to the pty if it changed and no resize came within resize_delay_msec
+    // returns true if sent
+    bool ReportSize(uint64_t now_msec);
+
     void DropFirstRowIfOverflow();
 
+    // append a line of width cells to history, only rows of the normal screen go there,
+    // see history_ring::PushBack()
+    history_line &PushHistory(int width);
+
+    // the first screen row was erased and no longer continues the last line of history
+    void UnwrapHistory();
+
+    // rewrap the normal screen to a new size, rows pushed off the top go to history
+    void ReflowScreen(int new_term_row, int new_term_col);
+
+    // reflow stale history until at least the latest lines are as wide as the screen
+    void ReflowHistory(size_t lines);
+
+    // swap buffer and alt_buffer if not already on the requested screen
+    void SwitchScreen(bool alternate);
+
     void InsertUtf8(uint32_t codepoint);
 
+    // insert a run of printable ascii characters
+    void InsertPrintable(const uint8_t *data, size_t length);
+
+    // insert a batch of decoded codepoints, row by row
+    void InsertCodepoints(const uint32_t *codepoints, size_t length);
+
+    // IRM: move characters from cursor rightward by count columns
+    void ShiftRight(int count);
+
+    // REP: print last_codepoint count times, filling a row at a time
+    void Repeat(int count);
+
+    // rectangle Pt ; Pl ; Pb ; Pr from parameter index on, see DECFRA/DECERA/DECCRA
+    // sets 0-based rows [top, bottom) and columns [left, right) on screen, relative to origin mode
+    // returns false if empty
+    bool GetRect(const csi_params &csi, int index, int &top, int &left, int &bottom, int &right);
+
+    // attach the codepoint to the grapheme cluster before cursor
+    // returns false if it starts a new cell
+    bool Combine(uint32_t codepoint, int cw);
+
+    // free grapheme clusters no longer referenced by any cell
+    void CollectGraphemes();
+
+    // id of current_style for new cells
+    inline uint32_t CurrentStyleId() {
+        if (!(current_style == interned_style)) {
+            InternCurrentStyle();
+        }
+        return current_style_id;
+    }
+    void InternCurrentStyle();
+
+    // blank cell for the current background color
+    inline term_char Blank() {
+        if (current_style.back.value != blank_back.value) {
+            InternBlank();
+        }
+        return blank;
+    }
+    void InternBlank();
+
+    // id of a style for new cells, reclaiming unused styles when the table is full and a sweep is due,
+    // or the default style
+    uint32_t InternStyle(const term_style &style);
+
+    // free styles no longer referenced by any cell
+    void CollectStyles();
+
+    // style of a cell
+    inline const term_style &Style(const term_char &c) const { return styles.Get(c.style_id); }
+
+    // text of a line in utf8, grapheme clusters resolved
+    std::string LineText(const_term_row line) const;
+
     // clamp cursor to valid range
     void ClampCursor();
 
@@ -180,12 +939,51 @@ struct terminal_context {
     // write data to pty until fully sent
     void WriteFull(uint8_t *data, size_t length);
 
+    // handle C0 control characters
+    void HandleControl(uint8_t input);
+
+    // handle escape sequences without CSI/OSC/DCS
+    void HandleESC(const csi_params &csi, uint8_t current);
+
     // handle CSI escape sequences
-    void HandleCSI(uint8_t current);
+    void HandleCSI(const csi_params &csi, uint8_t current);
+
+    // apply CSI Pm m, SGR, to style without cache
+    void HandleSGR(const csi_params &csi, term_style &style, bool warn = true);
+
+    // effect of CSI Pm m, SGR, on any style
+    sgr_delta SGRDelta(const csi_params &csi);
 
+    // handle OSC escape sequences
+    void HandleOSC(int command, const std::string &data);
 
+    // parse X11 color spec, returns false if unsupported
+    static bool ParseColorSpec(const std::string &spec, uint32_t &rgb);
+
+    // send OSC Ps ; [index ;] rgb:... ST
+    void ReportColor(int command, int index, uint32_t rgb);
+
+    // second stage of parsing: apply tokens to the terminal
+    // assume lock is held
+    void Apply(const token_batch &batch);
+
+    // return damage since the last call and start over, so each change is reported once
+    // assume lock is held
+    term_damage TakeDamage();
+
+    // publish a snapshot of the current screen and cursor
+    // assume lock is held
+    void Publish();
+
+    // latest published snapshot, without lock
+    inline std::shared_ptr<const term_snapshot> LatestSnapshot() const { return std::atomic_load(&snapshot); }
+
+    // tokenize and apply, for single threaded usage
     void Parse(uint8_t input);
 
+    // parse a chunk of pty output, tokenize and apply at once
+    void ParseBuffer(const uint8_t *data, size_t length);
+
     // wrapper that calls ctx->Worker
     static void *TerminalWorker(void * data);
     // poll fds and feed to terminal Parse
@@ -202,8 +1000,12 @@ void Start();
 void StartRender();
 // send data to terminal
 void SendData(uint8_t *data, size_t length);
-// resize window
+// resize window, applied once per frame
 void Resize(int width, int height);
+// trailing delay before the shell is told about a new size
+void SetResizeDelay(int msec);
+// east asian ambiguous characters take two columns, narrow by default like libc wcwidth
+void SetAmbiguousWide(bool wide);
 void ScrollBy(double offset);
 
 // implemented by code in napi/glfw
@@ -3,6 +3,10 @@ export const send: (content: ArrayBuffer) => void;
 export const createSurface: (id: BigInt) => void;
 export const destroySurface: (id: BigInt) => void;
 export const resizeSurface: (id: BigInt, width: number, height: number) => void;
+// delay in milliseconds before the shell is told about a new size
+export const setResizeDelay: (msec: number) => void;
+// east asian ambiguous characters take two columns, a user setting, narrow by default
+export const setAmbiguousWide: (wide: boolean) => void;
 export const scroll: (offset: number) => void;
 // poll if any thing to copy/paste
 export const checkCopy: () => string | undefined;